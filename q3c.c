@@ -1,299 +1,1508 @@
-#include <stdio.h>
-#include <string.h>
-#include <stdlib.h>
-#include <math.h>
-#include <emmintrin.h>  // SSE2
-#include <immintrin.h>  // AVX/AVX2
-#include <dirent.h>
-
-// Function declarations
-void Gaussian_Blur(int M, int N);
-void Sobel(int M, int N);
-int initialize_kernel();
-void read_image(const char* filename, int M, int N);
-void write_image2(const char* filename, unsigned char* output_image, int M, int N);
-void openfile(const char* filename, FILE** finput);
-int getint(FILE* fp);
-
-// Dynamic arrays for image processing
-unsigned char* frame1 = NULL; // Input image
-unsigned char* filt = NULL; // Output filtered image
-unsigned char* gradient = NULL; // Output image
-
-const signed char Mask[5][5] = {
-    {2,4,5,4,2} ,
-    {4,9,12,9,4},
-    {5,12,15,12,5},
-    {4,9,12,9,4},
-    {2,4,5,4,2}
-};
-
-char header[100];
-
-int main() {
-    DIR *d;
-    struct dirent *dir;
-
-    d = opendir("input_images");
-    if (!d) {
-        fprintf(stderr, "Could not open input_images directory\n");
-        return 1;
-    }
-
-    while ((dir = readdir(d)) != NULL) {
-        // Check if it's a regular file and has a .pgm extension
-        if (dir->d_type == DT_REG && strstr(dir->d_name, ".pgm")) {
-            char input_image_path[1024];
-            snprintf(input_image_path, sizeof(input_image_path), "input_images/%s", dir->d_name);
-
-            int M, N;
-            // Open file to determine the dimensions (M and N)
-            FILE* finput = fopen(input_image_path, "rb");
-            if (!finput) {
-                fprintf(stderr, "Could not open file: %s\n", input_image_path);
-                continue;
-            }
-
-            fscanf(finput, "%s", header);
-            M = getint(finput); // Get width (M)
-            N = getint(finput); // Get height (N)
-            fclose(finput);
-
-            // Allocate memory dynamically for the current image size
-            frame1 = (unsigned char*)malloc(N * M);
-            filt = (unsigned char*)malloc(N * M);
-            gradient = (unsigned char*)malloc(N * M);
-
-            if (!frame1 || !filt || !gradient) {
-                fprintf(stderr, "Memory allocation failed\n");
-                return 1;
-            }
-
-            // Generate output filenames
-            char output_blur_path[1024];
-            char output_edge_path[1024];
-            snprintf(output_blur_path, sizeof(output_blur_path), "output_images/%s_blur.pgm", dir->d_name);
-            snprintf(output_edge_path, sizeof(output_edge_path), "output_images/%s_edge.pgm", dir->d_name);
-
-            read_image(input_image_path, M, N); // Read image
-
-            Gaussian_Blur(M, N); // Apply Gaussian Blur (reduce noise)
-            Sobel(M, N); // Apply Sobel edge detection using intrinsics
-
-            write_image2(output_blur_path, filt, M, N); // Save blurred image
-            write_image2(output_edge_path, gradient, M, N); // Save edge detection image
-
-            // Free dynamically allocated memory
-            free(frame1);
-            free(filt);
-            free(gradient);
-        }
-    }
-
-    closedir(d);
-    return 0;
-}
-
-void Gaussian_Blur(int M, int N) {
-    int row, col, rowOffset, colOffset;
-    int newPixel;
-    unsigned char pix;
-    const unsigned short int size = 2;
-
-    /*---------------------- Gaussian Blur ---------------------------------*/
-    for (row = 0; row < N; row++) {
-        for (col = 0; col < M; col++) {
-            newPixel = 0;
-            for (rowOffset = -size; rowOffset <= size; rowOffset++) {
-                for (colOffset = -size; colOffset <= size; colOffset++) {
-
-                    if ((row + rowOffset < 0) || (row + rowOffset >= N) || (col + colOffset < 0) || (col + colOffset >= M))
-                        pix = 0;
-                    else
-                        pix = frame1[M * (row + rowOffset) + col + colOffset];
-
-                    newPixel += pix * Mask[size + rowOffset][size + colOffset];
-                }
-            }
-            filt[M * row + col] = (unsigned char)(newPixel / 159);
-        }
-    }
-}
-
-
-
-
-void Sobel(int M, int N) {
-    int row, col;
-
-    /* Define masks for Gx and Gy */
-    __m128i GxMask = _mm_set_epi8(1, 0, -1, 2, 0, -2, 1, 0, -1, 1, 0, -1, 2, 0, -2, 1);
-    __m128i GyMask = _mm_set_epi8(-1, -2, -1, 0, 0, 0, 1, 2, 1, -1, -2, -1, 0, 0, 0, 1);
-
-    /*---------------------------- Determine edge directions and gradient strengths -------------------------------------------*/
-    for (row = 1; row < N - 1; row++) {
-        for (col = 1; col < M - 1; col++) {
-
-            __m128i Gx = _mm_setzero_si128();
-            __m128i Gy = _mm_setzero_si128();
-
-            // Load pixel values from the image
-            __m128i p1 = _mm_set_epi8(
-                filt[M * (row - 1) + (col - 1)],
-                filt[M * (row - 1) + col],
-                filt[M * (row - 1) + (col + 1)],
-                filt[M * row + (col - 1)],
-                filt[M * row + col],
-                filt[M * row + (col + 1)],
-                filt[M * (row + 1) + (col - 1)],
-                filt[M * (row + 1) + col],
-                filt[M * (row + 1) + (col + 1)],
-                filt[M * (row - 1) + (col - 1)],
-                filt[M * (row - 1) + col],
-                filt[M * (row - 1) + (col + 1)],
-                filt[M * row + (col - 1)],
-                filt[M * row + col],
-                filt[M * row + (col + 1)],
-                filt[M * (row + 1) + (col - 1)]
-            );
-
-            // Multiply-add pixels with Sobel masks for Gx and Gy
-            Gx = _mm_maddubs_epi16(p1, GxMask);
-            Gy = _mm_maddubs_epi16(p1, GyMask);
-
-            // Sum the results horizontally to obtain the final Gx and Gy values
-            Gx = _mm_add_epi16(Gx, _mm_shuffle_epi32(Gx, _MM_SHUFFLE(1, 0, 3, 2)));
-            Gx = _mm_add_epi16(Gx, _mm_shufflelo_epi16(Gx, _MM_SHUFFLE(1, 0, 3, 2)));
-            Gy = _mm_add_epi16(Gy, _mm_shuffle_epi32(Gy, _MM_SHUFFLE(1, 0, 3, 2)));
-            Gy = _mm_add_epi16(Gy, _mm_shufflelo_epi16(Gy, _MM_SHUFFLE(1, 0, 3, 2)));
-
-            // Calculate gradient magnitude (approximate)
-            __m128i G = _mm_add_epi16(Gx, Gy);
-
-            // Convert back to 8-bit and store in the output gradient image
-            G = _mm_packus_epi16(G, G);
-            gradient[M * row + col] = (unsigned char)_mm_extract_epi8(G, 0);
-        }
-    }
-}
-
-
-
-
-void read_image(const char* filename, int M, int N) {
-    int c;
-    FILE* finput;
-    int i, j, temp;
-
-    printf("\nReading %s image from disk ...", filename);
-    finput = NULL;
-    openfile(filename, &finput);
-
-    if ((header[0] == 'P') && (header[1] == '5')) { // If P5 image
-
-        for (j = 0; j < N; j++) {
-            for (i = 0; i < M; i++) {
-                temp = getc(finput);
-                frame1[M * j + i] = (unsigned char)temp;
-            }
-        }
-    }
-    else if ((header[0] == 'P') && (header[1] == '2')) { // If P2 image
-        for (j = 0; j < N; j++) {
-            for (i = 0; i < M; i++) {
-                if (fscanf(finput, "%d", &temp) == EOF)
-                    exit(EXIT_FAILURE);
-
-                frame1[M * j + i] = (unsigned char)temp;
-            }
-        }
-    }
-    else {
-        printf("\nProblem with reading the image");
-        exit(EXIT_FAILURE);
-    }
-
-    fclose(finput);
-    printf("\nImage successfully read from disk\n");
-}
-
-void write_image2(const char* filename, unsigned char* output_image, int M, int N) {
-    FILE* foutput;
-    int i, j;
-
-    printf("  Writing result to disk ...\n");
-
-    foutput = fopen(filename, "wb");
-    if (foutput == NULL) {
-        fprintf(stderr, "Unable to open file %s for writing\n", filename);
-        exit(-1);
-    }
-
-    fprintf(foutput, "P2\n");
-    fprintf(foutput, "%d %d\n", M, N);
-    fprintf(foutput, "%d\n", 255);
-
-    for (j = 0; j < N; ++j) {
-        for (i = 0; i < M; ++i) {
-            fprintf(foutput, "%3d ", output_image[M * j + i]);
-            if (i % 32 == 31) fprintf(foutput, "\n");
-        }
-        if (M % 32 != 0) fprintf(foutput, "\n");
-    }
-    fclose(foutput);
-}
-
-void openfile(const char* filename, FILE** finput) {
-    int x0, y0, x;
-
-    *finput = fopen(filename, "rb");
-    if (*finput == NULL) {
-        fprintf(stderr, "Unable to open file %s for reading\n", filename);
-        exit(-1);
-    }
-
-    fscanf(*finput, "%s", header);
-
-    x0 = getint(*finput); // This is M (width)
-    y0 = getint(*finput); // This is N (height)
-    printf("\t Header is %s, while x=%d, y=%d", header, x0, y0);
-
-    x = getint(*finput); /* Read and throw away the range info */
-}
-
-int getint(FILE* fp) {
-    int c, i, firstchar;
-
-    c = getc(fp);
-    while (1) {
-        if (c == '#') {
-            char cmt[256], *sp;
-            sp = cmt;
-            firstchar = 1;
-            while (1) {
-                c = getc(fp);
-                if (firstchar && c == ' ') firstchar = 0;
-                else {
-                    if (c == '\n' || c == EOF) break;
-                    if ((sp - cmt) < 250) *sp++ = c;
-                }
-            }
-            *sp++ = '\n';
-            *sp = '\0';
-        }
-
-        if (c == EOF) return 0;
-        if (c >= '0' && c <= '9') break;
-
-        c = getc(fp);
-    }
-
-    i = 0;
-    while (1) {
-        i = (i * 10) + (c - '0');
-        c = getc(fp);
-        if (c == EOF) return i;
-        if (c < '0' || c > '9') break;
-    }
-    return i;
-}
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <emmintrin.h>  // SSE2
+#include <immintrin.h>  // AVX/AVX2
+#include <dirent.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Function declarations
+void Gaussian_Blur(int M, int N);
+void Sobel(int M, int N);
+void Blur_Sobel_Fused(int M, int N, unsigned char* blur_out);
+void Blur_Sobel_Tiled(int M, int N, unsigned char* blur_out);
+int run_pipeline(DIR* d, int workers, int depth);
+void* pool_get(size_t size);
+void pool_put(void* p, size_t size);
+void pool_report(void);
+void pool_destroy(void);
+int initialize_kernel();
+void read_image(const char* filename, int M, int N);
+void read_image_into(const char* filename, unsigned char* frame, int M, int N);
+void write_image2(const char* filename, unsigned char* output_image, int M, int N);
+void openfile(const char* filename, FILE** finput);
+int getint(FILE* fp);
+
+// Dynamic arrays for image processing
+unsigned char* frame1 = NULL; // Input image
+unsigned char* filt = NULL; // Output filtered image
+unsigned char* gradient = NULL; // Output image
+
+// Pixels of one image from load_image. P5 payloads are used in place from a
+// read-only mapping of the file; P2 files and fallbacks get a pooled copy.
+struct pgm_input {
+    unsigned char* pixels;
+    size_t size; // bytes at pixels when pooled
+    void* map;
+    size_t map_len;
+};
+struct pgm_input input1; // Backing of frame1
+
+void load_image(const char* filename, int M, int N, struct pgm_input* in);
+void stream_image(const char* filename, const char* blur_path, const char* edge_path, int M, int N, int S);
+void release_image(struct pgm_input* in);
+
+const signed char Mask[5][5] = {
+    {2,4,5,4,2} ,
+    {4,9,12,9,4},
+    {5,12,15,12,5},
+    {4,9,12,9,4},
+    {2,4,5,4,2}
+};
+
+char header[100];
+
+// Gradient magnitude. SOBEL_EXACT reproduces q3b.c, whose
+// (unsigned char)sqrt(Gx*Gx + Gy*Gy) truncates to int and keeps the low byte
+// for magnitudes above 255. SOBEL_L1 is the cheaper |Gx| + |Gy| saturated to
+// 255, for callers that accept the approximation.
+enum sobel_magnitude { SOBEL_EXACT, SOBEL_L1 };
+enum sobel_magnitude sobel_mode = SOBEL_EXACT;
+
+int fused = 0; // Run blur and Sobel as one row pipeline (Blur_Sobel_Fused)
+int tiled = 0; // Run blur and Sobel per tile on all threads (Blur_Sobel_Tiled)
+int write_blur = 1; // Also save the blurred image; off with --edges-only
+int workers = 0; // Compute workers for the batch pipeline; 0 runs images one at a time
+int queue_depth = 0; // Images per pipeline queue; 0 means 2 * workers
+int output_p5 = 0; // Write binary P5 instead of ASCII P2
+int pool_stats = 0; // Print buffer pool statistics at exit
+int stream_rows = 0; // Strip height for --stream (at least 1); 0 loads whole images
+
+// Size-classed cache of image buffers shared by all threads (pool_get and
+// pool_put). Each class keeps an intrusive free list of 64-byte-aligned
+// blocks; --hugepages backs blocks of 2 MB and up with THP-advised mmaps.
+#define POOL_CLASSES 160
+struct buffer_pool {
+    void* free_list[POOL_CLASSES];
+    size_t cached_bytes; // sitting in free lists
+    size_t in_use_bytes; // handed out and not yet returned
+    size_t high_water; // peak of in_use_bytes
+    unsigned long requests, hits;
+    int hugepages;
+    pthread_mutex_t lock;
+};
+struct buffer_pool pool = { { NULL }, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+int main(int argc, char* argv[]) {
+    DIR *d;
+    struct dirent *dir;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--l1") == 0)
+            sobel_mode = SOBEL_L1; // |Gx| + |Gy| instead of the exact magnitude
+        else if (strcmp(argv[i], "--fused") == 0)
+            fused = 1;
+        else if (strcmp(argv[i], "--tiled") == 0)
+            tiled = 1;
+        else if (strcmp(argv[i], "--edges-only") == 0)
+            write_blur = 0;
+        else if (strcmp(argv[i], "--p5") == 0)
+            output_p5 = 1;
+        else if (strcmp(argv[i], "--hugepages") == 0)
+            pool.hugepages = 1;
+        else if (strcmp(argv[i], "--pool-stats") == 0)
+            pool_stats = 1;
+        else if (strcmp(argv[i], "--stream") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+            stream_rows = atoi(argv[++i]); // A strip needs at least one row
+        else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+            workers = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--queue") == 0 && i + 1 < argc)
+            queue_depth = atoi(argv[++i]);
+        else {
+            fprintf(stderr, "Usage: %s [--l1] [--fused] [--tiled] [--edges-only] [--p5] [--hugepages] [--pool-stats] [--stream ROWS | --workers N [--queue D]]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (stream_rows > 0 && workers > 0) {
+        fprintf(stderr, "--stream and --workers cannot be combined\n");
+        return 1;
+    }
+    if (stream_rows > 0 && (fused || tiled)) {
+        // stream_image has its own strip pipeline and would ignore them
+        fprintf(stderr, "--stream cannot be combined with --fused or --tiled\n");
+        return 1;
+    }
+
+    d = opendir("input_images");
+    if (!d) {
+        fprintf(stderr, "Could not open input_images directory\n");
+        return 1;
+    }
+
+    if (workers > 0) {
+        int status = run_pipeline(d, workers, queue_depth > 0 ? queue_depth : 2 * workers);
+        closedir(d);
+        if (pool_stats)
+            pool_report();
+        pool_destroy();
+        return status;
+    }
+
+    while ((dir = readdir(d)) != NULL) {
+        // Check if it's a regular file and has a .pgm extension
+        if (dir->d_type == DT_REG && strstr(dir->d_name, ".pgm")) {
+            char input_image_path[1024];
+            snprintf(input_image_path, sizeof(input_image_path), "input_images/%s", dir->d_name);
+
+            int M, N;
+            // Open file to determine the dimensions (M and N)
+            FILE* finput = fopen(input_image_path, "rb");
+            if (!finput) {
+                fprintf(stderr, "Could not open file: %s\n", input_image_path);
+                continue;
+            }
+
+            fscanf(finput, "%s", header);
+            M = getint(finput); // Get width (M)
+            N = getint(finput); // Get height (N)
+            fclose(finput);
+
+            // Generate output filenames
+            char output_blur_path[1024];
+            char output_edge_path[1024];
+            snprintf(output_blur_path, sizeof(output_blur_path), "output_images/%s_blur.pgm", dir->d_name);
+            snprintf(output_edge_path, sizeof(output_edge_path), "output_images/%s_edge.pgm", dir->d_name);
+
+            if (stream_rows > 0) {
+                // Read, filter and write in strips; no full-size buffers
+                stream_image(input_image_path, write_blur ? output_blur_path : NULL, output_edge_path, M, N, stream_rows);
+                continue;
+            }
+
+            // Allocate memory dynamically for the current image size. The fused
+            // and tiled pipelines only need filt when the blurred image is saved.
+            int need_filt = write_blur || !(fused || tiled);
+            filt = need_filt ? (unsigned char*)pool_get((size_t)N * M) : NULL;
+            gradient = (unsigned char*)pool_get((size_t)N * M);
+
+            if ((need_filt && !filt) || !gradient) {
+                fprintf(stderr, "Memory allocation failed\n");
+                return 1;
+            }
+
+            load_image(input_image_path, M, N, &input1); // Read image
+            frame1 = input1.pixels;
+
+            if (tiled) {
+                Blur_Sobel_Tiled(M, N, filt); // Blur and Sobel per tile on all threads
+            }
+            else if (fused) {
+                Blur_Sobel_Fused(M, N, filt); // Blur and Sobel in one pass over the rows
+            }
+            else {
+                Gaussian_Blur(M, N); // Apply Gaussian Blur (reduce noise)
+                Sobel(M, N); // Apply Sobel edge detection
+            }
+
+            if (write_blur)
+                write_image2(output_blur_path, filt, M, N); // Save blurred image
+            write_image2(output_edge_path, gradient, M, N); // Save edge detection image
+
+            // Free dynamically allocated memory
+            release_image(&input1);
+            frame1 = NULL;
+            pool_put(filt, (size_t)N * M);
+            pool_put(gradient, (size_t)N * M);
+        }
+    }
+
+    closedir(d);
+    if (pool_stats)
+        pool_report();
+    pool_destroy();
+    return 0;
+}
+
+/*---------------------- Buffer Pool ----------------------------------*/
+
+#define POOL_ALIGN 64
+#define POOL_MIN_SIZE ((size_t)4096)
+#define POOL_HUGE_SIZE ((size_t)2 << 20)
+#define POOL_CACHE_LIMIT ((size_t)1 << 30) // cached bytes beyond this are freed
+
+// Class k holds blocks of POOL_MIN_SIZE * 2^(k/4) * (1 + (k%4)/4) bytes: four
+// classes per octave, so a block is at most 25% larger than the request and
+// same-sized images always land in the same class. Returns -1, with
+// *class_size = size, for requests beyond the largest class.
+static int pool_class(size_t size, size_t* class_size) {
+    int k;
+
+    for (k = 0; k < POOL_CLASSES; k++) {
+        size_t base = POOL_MIN_SIZE << (k / 4);
+        size_t cs = base + base / 4 * (k % 4);
+        if (cs >= size) {
+            *class_size = cs;
+            return k;
+        }
+    }
+    *class_size = size;
+    return -1;
+}
+
+static int pool_huge(size_t class_size) {
+    return pool.hugepages && class_size >= POOL_HUGE_SIZE;
+}
+
+// Length of the mapping behind a huge block: the class rounded up to whole
+// huge pages, so no block ends in a partial one that falls back to 4 KB pages.
+static size_t pool_huge_len(size_t class_size) {
+    return (class_size + POOL_HUGE_SIZE - 1) & ~(POOL_HUGE_SIZE - 1);
+}
+
+static void* pool_alloc_raw(size_t class_size) {
+    void* p;
+
+    if (pool_huge(class_size)) {
+        // Map one huge page extra, then unmap the head and tail around the
+        // first 2 MB boundary so the block starts on one
+        size_t len = pool_huge_len(class_size);
+        char* map = mmap(NULL, len + POOL_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        char* start;
+        size_t head;
+
+        if (map == MAP_FAILED)
+            return NULL;
+        start = (char*)(((size_t)map + POOL_HUGE_SIZE - 1) & ~(POOL_HUGE_SIZE - 1));
+        head = (size_t)(start - map);
+        if (head)
+            munmap(map, head);
+        munmap(start + len, POOL_HUGE_SIZE - head);
+#ifdef MADV_HUGEPAGE
+        madvise(start, len, MADV_HUGEPAGE);
+#endif
+        return start;
+    }
+    if (posix_memalign(&p, POOL_ALIGN, class_size) != 0)
+        return NULL;
+    return p;
+}
+
+static void pool_free_raw(void* p, size_t class_size) {
+    if (pool_huge(class_size))
+        munmap(p, pool_huge_len(class_size));
+    else
+        free(p);
+}
+
+// A 64-byte-aligned buffer of at least size bytes, reused from an earlier
+// pool_put of the same size class when one is free, so repeated images of
+// one shape skip both the allocator and first-touch page faults. NULL when
+// memory runs out.
+void* pool_get(size_t size) {
+    size_t class_size;
+    int k = pool_class(size, &class_size);
+    void* p = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.requests++;
+    if (k >= 0 && pool.free_list[k]) {
+        p = pool.free_list[k];
+        pool.free_list[k] = *(void**)p;
+        pool.cached_bytes -= class_size;
+        pool.hits++;
+    }
+    pool.in_use_bytes += class_size;
+    if (pool.in_use_bytes > pool.high_water)
+        pool.high_water = pool.in_use_bytes;
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!p) {
+        p = pool_alloc_raw(class_size);
+        if (!p) {
+            pthread_mutex_lock(&pool.lock);
+            pool.in_use_bytes -= class_size;
+            pthread_mutex_unlock(&pool.lock);
+        }
+    }
+    return p;
+}
+
+// Returns a pool_get buffer; size must be the size it was requested with.
+void pool_put(void* p, size_t size) {
+    size_t class_size;
+    int k = pool_class(size, &class_size);
+    int cached = 0;
+
+    if (!p)
+        return;
+    pthread_mutex_lock(&pool.lock);
+    pool.in_use_bytes -= class_size;
+    if (k >= 0 && pool.cached_bytes + class_size <= POOL_CACHE_LIMIT) {
+        *(void**)p = pool.free_list[k];
+        pool.free_list[k] = p;
+        pool.cached_bytes += class_size;
+        cached = 1;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (!cached)
+        pool_free_raw(p, class_size);
+}
+
+void pool_report(void) {
+    pthread_mutex_lock(&pool.lock);
+    printf("Buffer pool: %lu requests, %lu hits (%.1f%%), high-water %.1f MB in use, %.1f MB cached\n",
+        pool.requests, pool.hits, pool.requests ? 100.0 * pool.hits / pool.requests : 0.0,
+        pool.high_water / 1048576.0, pool.cached_bytes / 1048576.0);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+void pool_destroy(void) {
+    int k;
+
+    pthread_mutex_lock(&pool.lock);
+    for (k = 0; k < POOL_CLASSES; k++) {
+        size_t base = POOL_MIN_SIZE << (k / 4);
+        size_t class_size = base + base / 4 * (k % 4);
+
+        while (pool.free_list[k]) {
+            void* p = pool.free_list[k];
+            pool.free_list[k] = *(void**)p;
+            pool_free_raw(p, class_size);
+        }
+    }
+    pool.cached_bytes = 0;
+    pthread_mutex_unlock(&pool.lock);
+}
+
+
+
+
+/*---------------------- Gaussian Blur ---------------------------------*/
+
+// newPixel / 159 as a multiply-shift. newPixel never exceeds 159 * 255, and
+// for 0 <= x <= 40545 ((x * 52759) >> 16) >> 7 equals x / 159 exactly, so the
+// SIMD path can use a 16-bit high multiply instead of a division.
+#define BLUR_DIV_MUL 52759
+#define BLUR_DIV_SHIFT 7
+
+// One output pixel with the bounds checks of the original loop. rows[] holds
+// the five input rows centred on the output row, NULL for rows outside the
+// image; out-of-image taps contribute zero.
+static unsigned char blur_pixel(const unsigned char* const rows[5], int col, int M) {
+    int rowOffset, colOffset;
+    int newPixel = 0;
+    const int size = 2;
+
+    for (rowOffset = -size; rowOffset <= size; rowOffset++) {
+        const unsigned char* src = rows[size + rowOffset];
+        if (src == NULL)
+            continue;
+        for (colOffset = -size; colOffset <= size; colOffset++) {
+            if ((col + colOffset < 0) || (col + colOffset >= M))
+                continue;
+            newPixel += src[col + colOffset] * Mask[size + rowOffset][size + colOffset];
+        }
+    }
+    return (unsigned char)(newPixel / 159);
+}
+
+#if defined(__AVX2__)
+#define BLUR_VEC 16
+
+// 16 interior pixels centred on rows[2][col..col+15], stored at dst. Mask is
+// symmetric, so taps sharing a weight are summed first (at most 8 bytes, well
+// inside 16 bits) and each group is scaled once; the full sum peaks at 40545
+// and fits unsigned 16-bit.
+static void blur_vec(const unsigned char* const rows[5], int col, unsigned char* dst) {
+#define LD(r, c) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[r] + col + (c))))
+    __m256i w2 = _mm256_add_epi16(_mm256_add_epi16(LD(0, -2), LD(0, 2)), _mm256_add_epi16(LD(4, -2), LD(4, 2)));
+    __m256i w4 = _mm256_add_epi16(
+        _mm256_add_epi16(_mm256_add_epi16(LD(0, -1), LD(0, 1)), _mm256_add_epi16(LD(4, -1), LD(4, 1))),
+        _mm256_add_epi16(_mm256_add_epi16(LD(1, -2), LD(1, 2)), _mm256_add_epi16(LD(3, -2), LD(3, 2))));
+    __m256i w5 = _mm256_add_epi16(_mm256_add_epi16(LD(0, 0), LD(4, 0)), _mm256_add_epi16(LD(2, -2), LD(2, 2)));
+    __m256i w9 = _mm256_add_epi16(_mm256_add_epi16(LD(1, -1), LD(1, 1)), _mm256_add_epi16(LD(3, -1), LD(3, 1)));
+    __m256i w12 = _mm256_add_epi16(_mm256_add_epi16(LD(1, 0), LD(3, 0)), _mm256_add_epi16(LD(2, -1), LD(2, 1)));
+    __m256i w15 = LD(2, 0);
+#undef LD
+
+    __m256i sum = _mm256_mullo_epi16(w2, _mm256_set1_epi16(2));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(w4, _mm256_set1_epi16(4)));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(w5, _mm256_set1_epi16(5)));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(w9, _mm256_set1_epi16(9)));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(w12, _mm256_set1_epi16(12)));
+    sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(w15, _mm256_set1_epi16(15)));
+
+    __m256i q = _mm256_srli_epi16(_mm256_mulhi_epu16(sum, _mm256_set1_epi16((short)BLUR_DIV_MUL)), BLUR_DIV_SHIFT);
+    q = _mm256_permute4x64_epi64(_mm256_packus_epi16(q, q), _MM_SHUFFLE(3, 1, 2, 0));
+    _mm_storeu_si128((__m128i*)dst, _mm256_castsi256_si128(q));
+}
+#else
+#define BLUR_VEC 16
+
+// SSE2 version of the above: the 16 pixels are widened as two 8-lane halves.
+static __m128i blur_half(const unsigned char* const rows[5], int col, int hi) {
+    const __m128i zero = _mm_setzero_si128();
+#define LD(r, c) (hi ? _mm_unpackhi_epi8(_mm_loadu_si128((const __m128i*)(rows[r] + col + (c))), zero) \
+                     : _mm_unpacklo_epi8(_mm_loadu_si128((const __m128i*)(rows[r] + col + (c))), zero))
+    __m128i w2 = _mm_add_epi16(_mm_add_epi16(LD(0, -2), LD(0, 2)), _mm_add_epi16(LD(4, -2), LD(4, 2)));
+    __m128i w4 = _mm_add_epi16(
+        _mm_add_epi16(_mm_add_epi16(LD(0, -1), LD(0, 1)), _mm_add_epi16(LD(4, -1), LD(4, 1))),
+        _mm_add_epi16(_mm_add_epi16(LD(1, -2), LD(1, 2)), _mm_add_epi16(LD(3, -2), LD(3, 2))));
+    __m128i w5 = _mm_add_epi16(_mm_add_epi16(LD(0, 0), LD(4, 0)), _mm_add_epi16(LD(2, -2), LD(2, 2)));
+    __m128i w9 = _mm_add_epi16(_mm_add_epi16(LD(1, -1), LD(1, 1)), _mm_add_epi16(LD(3, -1), LD(3, 1)));
+    __m128i w12 = _mm_add_epi16(_mm_add_epi16(LD(1, 0), LD(3, 0)), _mm_add_epi16(LD(2, -1), LD(2, 1)));
+    __m128i w15 = LD(2, 0);
+#undef LD
+
+    __m128i sum = _mm_mullo_epi16(w2, _mm_set1_epi16(2));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(w4, _mm_set1_epi16(4)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(w5, _mm_set1_epi16(5)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(w9, _mm_set1_epi16(9)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(w12, _mm_set1_epi16(12)));
+    sum = _mm_add_epi16(sum, _mm_mullo_epi16(w15, _mm_set1_epi16(15)));
+
+    return _mm_srli_epi16(_mm_mulhi_epu16(sum, _mm_set1_epi16((short)BLUR_DIV_MUL)), BLUR_DIV_SHIFT);
+}
+
+static void blur_vec(const unsigned char* const rows[5], int col, unsigned char* dst) {
+    __m128i q = _mm_packus_epi16(blur_half(rows, col, 0), blur_half(rows, col, 1));
+    _mm_storeu_si128((__m128i*)dst, q);
+}
+#endif
+
+// Output pixels [c0, c1) of one row into out[0..c1-c0). Rows with all five
+// inputs present run the interior columns [2, M-2) through blur_vec; the
+// last vector is shifted back to end at the span's last interior column
+// rather than falling to scalar, which only rewrites identical values within
+// the span. The two border columns on each side, spans too narrow for a
+// vector and rows touching the top or bottom edge go through blur_pixel.
+static void blur_span(const unsigned char* const rows[5], unsigned char* out, int M, int c0, int c1) {
+    int col, r;
+    int v0 = c0 > 2 ? c0 : 2;
+    int v1 = c1 < M - 2 ? c1 : M - 2;
+
+    for (r = 0; r < 5; r++) {
+        if (rows[r] == NULL)
+            v1 = v0; // no vector part
+    }
+    if (v1 - v0 < BLUR_VEC) {
+        for (col = c0; col < c1; col++)
+            out[col - c0] = blur_pixel(rows, col, M);
+        return;
+    }
+
+    for (col = c0; col < v0; col++)
+        out[col - c0] = blur_pixel(rows, col, M);
+    for (col = v0; col + BLUR_VEC <= v1; col += BLUR_VEC)
+        blur_vec(rows, col, out + col - c0);
+    if (col < v1)
+        blur_vec(rows, v1 - BLUR_VEC, out + v1 - BLUR_VEC - c0);
+    for (col = v1; col < c1; col++)
+        out[col - c0] = blur_pixel(rows, col, M);
+}
+
+static void blur_row(const unsigned char* const rows[5], unsigned char* out, int M) {
+    blur_span(rows, out, M, 0, M);
+}
+
+void Gaussian_Blur(int M, int N) {
+    int row, r;
+    const unsigned char* rows[5];
+
+    for (row = 0; row < N; row++) {
+        for (r = 0; r < 5; r++) {
+            int src = row + r - 2;
+            rows[r] = (src < 0 || src >= N) ? NULL : frame1 + (size_t)M * src;
+        }
+        blur_row(rows, filt + (size_t)M * row, M);
+    }
+}
+
+
+
+
+/*---------------------- Sobel ----------------------------------------*/
+
+static unsigned char sobel_pixel(const unsigned char* const rows[3], int col) {
+    const unsigned char* r0 = rows[0];
+    const unsigned char* r1 = rows[1];
+    const unsigned char* r2 = rows[2];
+    int Gx = (r0[col + 1] - r0[col - 1]) + 2 * (r1[col + 1] - r1[col - 1]) + (r2[col + 1] - r2[col - 1]);
+    int Gy = (r2[col - 1] + 2 * r2[col] + r2[col + 1]) - (r0[col - 1] + 2 * r0[col] + r0[col + 1]);
+
+    if (sobel_mode == SOBEL_L1) {
+        int G = abs(Gx) + abs(Gy);
+        return (unsigned char)(G > 255 ? 255 : G);
+    }
+    return (unsigned char)(int)sqrt((double)(Gx * Gx + Gy * Gy));
+}
+
+// Gx and Gy for 16 adjacent pixels fit in int16 (|G| <= 1020). Gx*Gx + Gy*Gy
+// is at most 2080800, below 2^24, so it converts to float exactly, and
+// (int)sqrtf(v) == (int)sqrt(v) for every v in that range (checked
+// exhaustively), so the single-precision sqrt gives the same byte as q3b.c.
+#if defined(__AVX2__)
+#define SOBEL_VEC 16
+
+static __m128i sobel_mag_exact(__m256i Gx, __m256i Gy) {
+    __m256i lo = _mm256_unpacklo_epi16(Gx, Gy);
+    __m256i hi = _mm256_unpackhi_epi16(Gx, Gy);
+    __m256i mask = _mm256_set1_epi32(0xFF);
+
+    lo = _mm256_madd_epi16(lo, lo);
+    hi = _mm256_madd_epi16(hi, hi);
+    lo = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(lo))), mask);
+    hi = _mm256_and_si256(_mm256_cvttps_epi32(_mm256_sqrt_ps(_mm256_cvtepi32_ps(hi))), mask);
+
+    // The unpacks and packs both work within 128-bit lanes, so they cancel.
+    __m256i G = _mm256_packs_epi32(lo, hi);
+    G = _mm256_permute4x64_epi64(_mm256_packus_epi16(G, G), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_castsi256_si128(G);
+}
+
+static __m128i sobel_mag_l1(__m256i Gx, __m256i Gy) {
+    __m256i G = _mm256_adds_epu16(_mm256_abs_epi16(Gx), _mm256_abs_epi16(Gy));
+    G = _mm256_permute4x64_epi64(_mm256_packus_epi16(G, G), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm256_castsi256_si128(G);
+}
+
+// Gradient for rows[1][col..col+15] into dst, each of the three rows loaded
+// once per column offset.
+static void sobel_vec(const unsigned char* const rows[3], int col, unsigned char* dst) {
+#define LD(r, c) _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(rows[r] + col + (c))))
+    __m256i dx0 = _mm256_sub_epi16(LD(0, 1), LD(0, -1));
+    __m256i dx1 = _mm256_sub_epi16(LD(1, 1), LD(1, -1));
+    __m256i dx2 = _mm256_sub_epi16(LD(2, 1), LD(2, -1));
+    __m256i s0 = _mm256_add_epi16(_mm256_add_epi16(LD(0, -1), LD(0, 1)), _mm256_slli_epi16(LD(0, 0), 1));
+    __m256i s2 = _mm256_add_epi16(_mm256_add_epi16(LD(2, -1), LD(2, 1)), _mm256_slli_epi16(LD(2, 0), 1));
+#undef LD
+    __m256i Gx = _mm256_add_epi16(_mm256_add_epi16(dx0, dx2), _mm256_slli_epi16(dx1, 1));
+    __m256i Gy = _mm256_sub_epi16(s2, s0);
+
+    __m128i G = sobel_mode == SOBEL_L1 ? sobel_mag_l1(Gx, Gy) : sobel_mag_exact(Gx, Gy);
+    _mm_storeu_si128((__m128i*)dst, G);
+}
+#else
+#define SOBEL_VEC 8
+
+static __m128i sobel_abs_epi16(__m128i x) {
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// SSE2 version of the above, 8 pixels per step.
+static void sobel_vec(const unsigned char* const rows[3], int col, unsigned char* dst) {
+    const __m128i zero = _mm_setzero_si128();
+#define LD(r, c) _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[r] + col + (c))), zero)
+    __m128i dx0 = _mm_sub_epi16(LD(0, 1), LD(0, -1));
+    __m128i dx1 = _mm_sub_epi16(LD(1, 1), LD(1, -1));
+    __m128i dx2 = _mm_sub_epi16(LD(2, 1), LD(2, -1));
+    __m128i s0 = _mm_add_epi16(_mm_add_epi16(LD(0, -1), LD(0, 1)), _mm_slli_epi16(LD(0, 0), 1));
+    __m128i s2 = _mm_add_epi16(_mm_add_epi16(LD(2, -1), LD(2, 1)), _mm_slli_epi16(LD(2, 0), 1));
+#undef LD
+    __m128i Gx = _mm_add_epi16(_mm_add_epi16(dx0, dx2), _mm_slli_epi16(dx1, 1));
+    __m128i Gy = _mm_sub_epi16(s2, s0);
+    __m128i G;
+
+    if (sobel_mode == SOBEL_L1) {
+        G = _mm_adds_epu16(sobel_abs_epi16(Gx), sobel_abs_epi16(Gy));
+    } else {
+        __m128i lo = _mm_unpacklo_epi16(Gx, Gy);
+        __m128i hi = _mm_unpackhi_epi16(Gx, Gy);
+        __m128i mask = _mm_set1_epi32(0xFF);
+
+        lo = _mm_madd_epi16(lo, lo);
+        hi = _mm_madd_epi16(hi, hi);
+        lo = _mm_and_si128(_mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(lo))), mask);
+        hi = _mm_and_si128(_mm_cvttps_epi32(_mm_sqrt_ps(_mm_cvtepi32_ps(hi))), mask);
+        G = _mm_packs_epi32(lo, hi);
+    }
+    _mm_storel_epi64((__m128i*)dst, _mm_packus_epi16(G, G));
+}
+#endif
+
+// Gradient pixels [c0, c1) of one row into out[0..c1-c0). rows[] are the
+// three blurred rows around it, each starting at image column x0, so callers
+// can pass either full rows (x0 = 0) or a tile's halo buffer. The interior
+// columns [1, M-1) are vectorized with the same shifted-last-vector tail as
+// blur_span; the two edge columns, which q3b.c never writes, are set to 0.
+static void sobel_span(const unsigned char* const rows[3], int x0, unsigned char* out, int M, int c0, int c1) {
+    int col;
+    int v0 = c0 > 1 ? c0 : 1;
+    int v1 = c1 < M - 1 ? c1 : M - 1;
+
+    for (col = c0; col < v0; col++)
+        out[col - c0] = 0;
+    for (col = v1 > v0 ? v1 : v0; col < c1; col++)
+        out[col - c0] = 0;
+    if (v1 - v0 < SOBEL_VEC) {
+        for (col = v0; col < v1; col++)
+            out[col - c0] = sobel_pixel(rows, col - x0);
+        return;
+    }
+
+    for (col = v0; col + SOBEL_VEC <= v1; col += SOBEL_VEC)
+        sobel_vec(rows, col - x0, out + col - c0);
+    if (col < v1)
+        sobel_vec(rows, v1 - SOBEL_VEC - x0, out + v1 - SOBEL_VEC - c0);
+}
+
+static void sobel_row(const unsigned char* const rows[3], unsigned char* out, int M) {
+    sobel_span(rows, 0, out, M, 0, M);
+}
+
+void Sobel(int M, int N) {
+    int row;
+    const unsigned char* rows[3];
+
+    /*---------------------------- Determine edge directions and gradient strengths -------------------------------------------*/
+    for (row = 0; row < N; row++) {
+        if (row == 0 || row == N - 1) {
+            memset(gradient + (size_t)M * row, 0, M);
+            continue;
+        }
+        rows[0] = filt + (size_t)M * (row - 1);
+        rows[1] = filt + (size_t)M * row;
+        rows[2] = filt + (size_t)M * (row + 1);
+        sobel_row(rows, gradient + (size_t)M * row, M);
+    }
+}
+
+
+
+
+/*---------------------- Fused Blur + Sobel ----------------------------*/
+
+// Gaussian_Blur followed by Sobel as one pass over the rows. Blurring row r
+// completes the 3-row neighbourhood of gradient row r-1, which is emitted
+// straight away, so blurred pixels are consumed while still in cache instead
+// of making a round trip through a full-size filt. With blur_out == NULL the
+// blurred rows live in a 3-row ring and filt is never touched; otherwise they
+// are written to blur_out, which doubles as the window. Output is identical
+// to Gaussian_Blur + Sobel. Works on explicit buffers so the batch pipeline
+// can run one image per worker.
+static void blur_sobel_rows(const unsigned char* in, unsigned char* blur_out, unsigned char* edge, int M, int N) {
+    int row, r;
+    const unsigned char* rows[5];
+    const unsigned char* brows[3];
+    unsigned char* ring = NULL;
+
+    if (blur_out == NULL) {
+        ring = (unsigned char*)pool_get((size_t)3 * M);
+        if (!ring) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#define BLURRED(r) (blur_out ? blur_out + (size_t)M * (r) : ring + (size_t)M * ((r) % 3))
+
+    for (row = 0; row < N; row++) {
+        for (r = 0; r < 5; r++) {
+            int src = row + r - 2;
+            rows[r] = (src < 0 || src >= N) ? NULL : in + (size_t)M * src;
+        }
+        blur_row(rows, BLURRED(row), M);
+
+        // Gradient row row-1 now has both neighbours; row 0 is an edge row.
+        if (row == 1) {
+            memset(edge, 0, M);
+        }
+        else if (row >= 2) {
+            brows[0] = BLURRED(row - 2);
+            brows[1] = BLURRED(row - 1);
+            brows[2] = BLURRED(row);
+            sobel_row(brows, edge + (size_t)M * (row - 1), M);
+        }
+    }
+    memset(edge + (size_t)M * (N - 1), 0, M);
+#undef BLURRED
+
+    pool_put(ring, (size_t)3 * M);
+}
+
+void Blur_Sobel_Fused(int M, int N, unsigned char* blur_out) {
+    blur_sobel_rows(frame1, blur_out, gradient, M, N);
+}
+
+
+
+
+/*---------------------- Tiled Blur + Sobel ----------------------------*/
+
+// Tile shape for Blur_Sobel_Tiled. A tile's working set is its 68 input rows,
+// the 66-row blurred halo buffer and the gradient rows, each TILE_W + 4
+// bytes wide: about 100 KB, which stays in L2.
+#define TILE_W 512
+#define TILE_H 32
+
+// Blur and Sobel over independent TILE_W x TILE_H tiles on the OpenMP team
+// (sized by OMP_NUM_THREADS), or one after another when built without
+// OpenMP. Each tile blurs its core plus a 1-pixel halo
+// into a per-thread buffer, reading frame1 with the blur's own 2-pixel halo,
+// then runs Sobel on the core from that buffer. Halo pixels are recomputed by
+// neighbouring tiles instead of shared, so tiles never wait on each other and
+// each output byte has exactly one writer. The core is also copied to
+// blur_out when it is non-NULL. Output is identical to Gaussian_Blur + Sobel,
+// and to the untiled scalar version in q3b.c, which stays the reference.
+void Blur_Sobel_Tiled(int M, int N, unsigned char* blur_out) {
+    int tiles_x = (M + TILE_W - 1) / TILE_W;
+    int tiles_y = (N + TILE_H - 1) / TILE_H;
+    int failed = 0;
+
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+    {
+        unsigned char* halo = (unsigned char*)pool_get((size_t)(TILE_H + 2) * (TILE_W + 2));
+        int t;
+
+        if (!halo) {
+#ifdef _OPENMP
+#pragma omp atomic write
+#endif
+            failed = 1;
+        }
+#ifdef _OPENMP
+#pragma omp for schedule(dynamic)
+#endif
+        for (t = 0; t < tiles_x * tiles_y; t++) {
+            const unsigned char* rows[5];
+            const unsigned char* brows[3];
+            int r0 = (t / tiles_x) * TILE_H;
+            int c0 = (t % tiles_x) * TILE_W;
+            int r1 = r0 + TILE_H < N ? r0 + TILE_H : N;
+            int c1 = c0 + TILE_W < M ? c0 + TILE_W : M;
+            int hr0 = r0 > 0 ? r0 - 1 : 0;
+            int hc0 = c0 > 0 ? c0 - 1 : 0;
+            int hr1 = r1 < N ? r1 + 1 : N;
+            int hc1 = c1 < M ? c1 + 1 : M;
+            int hw = hc1 - hc0;
+            int row, r;
+
+            if (!halo)
+                continue;
+
+            for (row = hr0; row < hr1; row++) {
+                for (r = 0; r < 5; r++) {
+                    int src = row + r - 2;
+                    rows[r] = (src < 0 || src >= N) ? NULL : frame1 + (size_t)M * src;
+                }
+                blur_span(rows, halo + (size_t)(row - hr0) * hw, M, hc0, hc1);
+            }
+
+            for (row = r0; row < r1; row++) {
+                unsigned char* out = gradient + (size_t)M * row + c0;
+
+                if (blur_out)
+                    memcpy(blur_out + (size_t)M * row + c0, halo + (size_t)(row - hr0) * hw + (c0 - hc0), c1 - c0);
+                if (row == 0 || row == N - 1) {
+                    memset(out, 0, c1 - c0);
+                    continue;
+                }
+                for (r = 0; r < 3; r++)
+                    brows[r] = halo + (size_t)(row - 1 + r - hr0) * hw;
+                sobel_span(brows, hc0, out, M, c0, c1);
+            }
+        }
+        pool_put(halo, (size_t)(TILE_H + 2) * (TILE_W + 2));
+    }
+
+    if (failed) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+
+
+
+/*---------------------- Batch Pipeline -------------------------------*/
+
+// One image in flight through run_pipeline. The reader loads input, a worker
+// fills blur (when saved) and edge, and the writer saves and frees it.
+struct image_job {
+    char blur_path[1024];
+    char edge_path[1024];
+    int M, N;
+    struct pgm_input input;
+    unsigned char* blur;
+    unsigned char* edge;
+};
+
+// Bounded FIFO of jobs. push blocks while the queue is full, which is what
+// throttles a reader or worker that runs ahead of the stage after it; pop
+// blocks while it is empty and returns NULL once the queue is closed and
+// drained.
+struct job_queue {
+    struct image_job** items;
+    int capacity, head, count, closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full;
+};
+
+static int queue_init(struct job_queue* q, int capacity) {
+    q->items = (struct image_job**)malloc(sizeof(*q->items) * capacity);
+    q->capacity = capacity;
+    q->head = q->count = q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return q->items != NULL;
+}
+
+static void queue_destroy(struct job_queue* q) {
+    pthread_cond_destroy(&q->not_full);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_mutex_destroy(&q->lock);
+    free(q->items);
+}
+
+static void queue_push(struct job_queue* q, struct image_job* job) {
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    q->items[(q->head + q->count) % q->capacity] = job;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static struct image_job* queue_pop(struct job_queue* q) {
+    struct image_job* job = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count > 0) {
+        job = q->items[q->head];
+        q->head = (q->head + 1) % q->capacity;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+static void queue_close(struct job_queue* q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void free_job(struct image_job* job) {
+    release_image(&job->input);
+    pool_put(job->blur, (size_t)job->N * job->M);
+    pool_put(job->edge, (size_t)job->N * job->M);
+    free(job);
+}
+
+struct job_queue compute_queue; // reader -> workers
+struct job_queue write_queue; // workers -> writer
+
+// Each worker filters whole images with the fused row kernel on its own
+// core; --tiled is not used here, since the pipeline already keeps every
+// core busy with separate images.
+static void* pipeline_worker(void* arg) {
+    struct image_job* job;
+
+    (void)arg;
+    while ((job = queue_pop(&compute_queue)) != NULL) {
+        blur_sobel_rows(job->input.pixels, job->blur, job->edge, job->M, job->N);
+        release_image(&job->input); // not needed by the writer
+        queue_push(&write_queue, job);
+    }
+    return NULL;
+}
+
+static void* pipeline_writer(void* arg) {
+    struct image_job* job;
+
+    (void)arg;
+    while ((job = queue_pop(&write_queue)) != NULL) {
+        if (job->blur)
+            write_image2(job->blur_path, job->blur, job->M, job->N); // Save blurred image
+        write_image2(job->edge_path, job->edge, job->M, job->N); // Save edge detection image
+        free_job(job);
+    }
+    return NULL;
+}
+
+// Batch mode for --workers: the calling thread is the reader stage and walks
+// the directory, loading each image and queueing it; `workers` threads
+// filter images concurrently and a single writer thread saves them. Both
+// queues hold `depth` images, so at most 2 * depth + workers + 1 images are
+// in memory however far the reader gets ahead. Images are written in
+// completion order, which may differ from directory order.
+int run_pipeline(DIR* d, int workers, int depth) {
+    struct dirent *dir;
+    pthread_t* threads;
+    pthread_t writer;
+    int i, started = 0, status = 0;
+
+    threads = (pthread_t*)malloc(sizeof(pthread_t) * workers);
+    if (!threads || !queue_init(&compute_queue, depth) || !queue_init(&write_queue, depth)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        return 1;
+    }
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, pipeline_worker, NULL) != 0)
+            break;
+        started++;
+    }
+    if (started == 0 || pthread_create(&writer, NULL, pipeline_writer, NULL) != 0) {
+        fprintf(stderr, "Could not start pipeline threads\n");
+        exit(EXIT_FAILURE);
+    }
+
+    while ((dir = readdir(d)) != NULL) {
+        if (dir->d_type != DT_REG || !strstr(dir->d_name, ".pgm"))
+            continue;
+
+        char input_image_path[1024];
+        snprintf(input_image_path, sizeof(input_image_path), "input_images/%s", dir->d_name);
+
+        FILE* finput = fopen(input_image_path, "rb");
+        if (!finput) {
+            fprintf(stderr, "Could not open file: %s\n", input_image_path);
+            continue;
+        }
+        fscanf(finput, "%s", header);
+        int M = getint(finput); // Get width (M)
+        int N = getint(finput); // Get height (N)
+        fclose(finput);
+
+        struct image_job* job = (struct image_job*)calloc(1, sizeof(*job));
+        if (job) {
+            job->M = M;
+            job->N = N;
+            job->blur = write_blur ? (unsigned char*)pool_get((size_t)N * M) : NULL;
+            job->edge = (unsigned char*)pool_get((size_t)N * M);
+        }
+        if (!job || (write_blur && !job->blur) || !job->edge) {
+            fprintf(stderr, "Memory allocation failed\n");
+            if (job)
+                free_job(job);
+            status = 1;
+            break;
+        }
+        snprintf(job->blur_path, sizeof(job->blur_path), "output_images/%s_blur.pgm", dir->d_name);
+        snprintf(job->edge_path, sizeof(job->edge_path), "output_images/%s_edge.pgm", dir->d_name);
+
+        load_image(input_image_path, M, N, &job->input); // Read image
+        queue_push(&compute_queue, job);
+    }
+
+    // Drain: workers exit once the compute queue is empty, then the writer.
+    queue_close(&compute_queue);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    queue_close(&write_queue);
+    pthread_join(writer, NULL);
+
+    queue_destroy(&compute_queue);
+    queue_destroy(&write_queue);
+    free(threads);
+    return status;
+}
+
+
+
+
+/*---------------------- PGM Loading ----------------------------------*/
+
+// getint() over an in-memory header: skips non-digits and '#' comments, reads
+// the number and consumes the character after it, so *pos ends where getint
+// leaves the stream.
+static int mem_getint(const unsigned char* buf, size_t len, size_t* pos) {
+    size_t p = *pos;
+    int i = 0;
+
+    while (p < len && (buf[p] < '0' || buf[p] > '9')) {
+        if (buf[p] == '#') {
+            while (p < len && buf[p] != '\n')
+                p++;
+        }
+        if (p < len)
+            p++;
+    }
+    while (p < len && buf[p] >= '0' && buf[p] <= '9')
+        i = (i * 10) + (buf[p++] - '0');
+    if (p < len)
+        p++;
+    *pos = p;
+    return i;
+}
+
+// Bytes for the P2 tokenizer: a whole mapped file, or (fp set) a file read
+// through a chunk buffer, as stream_image does.
+struct byte_source {
+    const unsigned char* buf;
+    size_t pos, len;
+    FILE* fp;
+    unsigned char* chunk;
+    size_t chunk_size;
+};
+
+static int source_peek(struct byte_source* src) {
+    if (src->pos == src->len) {
+        if (!src->fp)
+            return EOF;
+        src->len = fread(src->chunk, 1, src->chunk_size, src->fp);
+        src->pos = 0;
+        src->buf = src->chunk;
+        if (src->len == 0)
+            return EOF;
+    }
+    return src->buf[src->pos];
+}
+
+// P2 payload with the semantics of fscanf("%d") per pixel (leading
+// whitespace, optional sign, truncating cast to unsigned char), without the
+// per-call stdio overhead. Running out of data exits like read_image does.
+static void parse_p2(struct byte_source* src, unsigned char* frame, size_t count) {
+    size_t k;
+    int c;
+
+    for (k = 0; k < count; k++) {
+        int neg = 0, v = 0;
+
+        while ((c = source_peek(src)) == ' ' || (c >= '\t' && c <= '\r'))
+            src->pos++;
+        if (c == '-' || c == '+') {
+            neg = c == '-';
+            src->pos++;
+            c = source_peek(src);
+        }
+        if (c == EOF)
+            exit(EXIT_FAILURE);
+        if (c < '0' || c > '9') {
+            printf("\nProblem with reading the image");
+            exit(EXIT_FAILURE);
+        }
+        while ((c = source_peek(src)) >= '0' && c <= '9') {
+            v = v * 10 + (c - '0');
+            src->pos++;
+        }
+        frame[k] = (unsigned char)(neg ? -v : v);
+    }
+}
+
+// Loads an M x N image into *in. The file is mapped read-only once; for P5
+// the pixels are used straight from the mapping, so nothing is copied and
+// pages fault in as the filters first touch them. P2 text is tokenized from
+// the mapping into a pooled frame, as is a P5 payload shorter than M * N,
+// padded with 255 the way getc's EOF was stored. Files that cannot be mapped
+// go through read_image_into.
+void load_image(const char* filename, int M, int N, struct pgm_input* in) {
+    size_t count = (size_t)M * N;
+    struct stat st;
+    unsigned char* buf = MAP_FAILED;
+    size_t len = 0, pos = 0;
+    char magic[100];
+    int k = 0;
+    int fd;
+
+    printf("\nReading %s image from disk ...", filename);
+    in->pixels = NULL;
+    in->size = 0;
+    in->map = NULL;
+    in->map_len = 0;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Unable to open file %s for reading\n", filename);
+        exit(-1);
+    }
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        len = (size_t)st.st_size;
+        buf = (unsigned char*)mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (buf == MAP_FAILED) {
+        in->pixels = (unsigned char*)pool_get(count);
+        if (!in->pixels) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        in->size = count;
+        read_image_into(filename, in->pixels, M, N);
+        return;
+    }
+
+    // Header as openfile() reads it: a %s token, then width, height, maxval.
+    while (pos < len && (buf[pos] == ' ' || (buf[pos] >= '\t' && buf[pos] <= '\r')))
+        pos++;
+    while (pos < len && k < 99 && !(buf[pos] == ' ' || (buf[pos] >= '\t' && buf[pos] <= '\r')))
+        magic[k++] = (char)buf[pos++];
+    magic[k] = '\0';
+    mem_getint(buf, len, &pos);
+    mem_getint(buf, len, &pos);
+    mem_getint(buf, len, &pos); /* Read and throw away the range info */
+
+    if ((magic[0] == 'P') && (magic[1] == '5') && len - pos >= count) { // P5, used in place
+        madvise(buf, len, MADV_WILLNEED);
+        in->pixels = buf + pos;
+        in->map = buf;
+        in->map_len = len;
+        printf("\nImage successfully read from disk\n");
+        return;
+    }
+
+    in->pixels = (unsigned char*)pool_get(count);
+    if (!in->pixels) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    in->size = count;
+    if ((magic[0] == 'P') && (magic[1] == '5')) { // Truncated P5
+        memcpy(in->pixels, buf + pos, len - pos);
+        memset(in->pixels + (len - pos), 255, count - (len - pos));
+    }
+    else if ((magic[0] == 'P') && (magic[1] == '2')) {
+        struct byte_source text = { buf, pos, len, NULL, NULL, 0 };
+        parse_p2(&text, in->pixels, count);
+    }
+    else {
+        printf("\nProblem with reading the image");
+        exit(EXIT_FAILURE);
+    }
+    munmap(buf, len);
+    printf("\nImage successfully read from disk\n");
+}
+
+void release_image(struct pgm_input* in) {
+    if (in->map)
+        munmap(in->map, in->map_len);
+    else
+        pool_put(in->pixels, in->size);
+    in->pixels = NULL;
+    in->size = 0;
+    in->map = NULL;
+    in->map_len = 0;
+}
+
+void read_image_into(const char* filename, unsigned char* frame, int M, int N) {
+    int c;
+    FILE* finput;
+    int i, j, temp;
+
+    printf("\nReading %s image from disk ...", filename);
+    finput = NULL;
+    openfile(filename, &finput);
+
+    if ((header[0] == 'P') && (header[1] == '5')) { // If P5 image
+
+        for (j = 0; j < N; j++) {
+            for (i = 0; i < M; i++) {
+                temp = getc(finput);
+                frame[M * j + i] = (unsigned char)temp;
+            }
+        }
+    }
+    else if ((header[0] == 'P') && (header[1] == '2')) { // If P2 image
+        for (j = 0; j < N; j++) {
+            for (i = 0; i < M; i++) {
+                if (fscanf(finput, "%d", &temp) == EOF)
+                    exit(EXIT_FAILURE);
+
+                frame[M * j + i] = (unsigned char)temp;
+            }
+        }
+    }
+    else {
+        printf("\nProblem with reading the image");
+        exit(EXIT_FAILURE);
+    }
+
+    fclose(finput);
+    printf("\nImage successfully read from disk\n");
+}
+
+void read_image(const char* filename, int M, int N) {
+    read_image_into(filename, frame1, M, N);
+}
+
+// Output buffer for write_image2; grown to one text row for very wide images.
+#define WRITE_BUF_SIZE (1 << 20)
+
+// "%3d " of every pixel value, so P2 rows are formatted with one 4-byte copy
+// per pixel instead of a printf call.
+static char pixel_text[256][4];
+static pthread_once_t pixel_text_once = PTHREAD_ONCE_INIT;
+
+static void init_pixel_text(void) {
+    int v;
+
+    for (v = 0; v < 256; v++) {
+        pixel_text[v][0] = v >= 100 ? (char)('0' + v / 100) : ' ';
+        pixel_text[v][1] = v >= 10 ? (char)('0' + v / 10 % 10) : ' ';
+        pixel_text[v][2] = (char)('0' + v % 10);
+        pixel_text[v][3] = ' ';
+    }
+}
+
+static void write_or_die(const void* data, size_t size, FILE* foutput, const char* filename) {
+    if (size > 0 && fwrite(data, 1, size, foutput) != size) {
+        fprintf(stderr, "Unable to write file %s\n", filename);
+        exit(-1);
+    }
+}
+
+// Incremental PGM writer: pgm_writer_open writes the header, pgm_writer_rows
+// appends whole rows and pgm_writer_close flushes. Output is ASCII P2 in the
+// original layout (32 values per line, a line break after every row), or
+// binary P5 with --p5. P2 text is built in a large buffer and handed to
+// fwrite in big blocks.
+struct pgm_writer {
+    FILE* fp;
+    const char* filename;
+    char* buf;
+    size_t buf_size, used, row_bytes;
+};
+
+static void pgm_writer_open(struct pgm_writer* w, const char* filename, int M, int N) {
+    w->filename = filename;
+    w->buf = NULL;
+    w->used = 0;
+    w->row_bytes = (size_t)4 * M + M / 32 + 1;
+    w->buf_size = w->row_bytes > WRITE_BUF_SIZE ? w->row_bytes : WRITE_BUF_SIZE;
+
+    w->fp = fopen(filename, "wb");
+    if (w->fp == NULL) {
+        fprintf(stderr, "Unable to open file %s for writing\n", filename);
+        exit(-1);
+    }
+
+    if (output_p5) {
+        fprintf(w->fp, "P5\n%d %d\n%d\n", M, N, 255);
+        return;
+    }
+
+    fprintf(w->fp, "P2\n");
+    fprintf(w->fp, "%d %d\n", M, N);
+    fprintf(w->fp, "%d\n", 255);
+
+    pthread_once(&pixel_text_once, init_pixel_text);
+    w->buf = (char*)pool_get(w->buf_size);
+    if (!w->buf) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void pgm_writer_rows(struct pgm_writer* w, const unsigned char* rows, int M, int count) {
+    int i, j;
+
+    if (output_p5) {
+        write_or_die(rows, (size_t)M * count, w->fp, w->filename);
+        return;
+    }
+
+    for (j = 0; j < count; ++j) {
+        const unsigned char* row = rows + (size_t)M * j;
+        char* buf = w->buf;
+        size_t used = w->used;
+
+        if (used + w->row_bytes > w->buf_size) {
+            write_or_die(buf, used, w->fp, w->filename);
+            used = 0;
+        }
+        for (i = 0; i < M; ++i) {
+            memcpy(buf + used, pixel_text[row[i]], 4);
+            used += 4;
+            if (i % 32 == 31) buf[used++] = '\n';
+        }
+        if (M % 32 != 0) buf[used++] = '\n';
+        w->used = used;
+    }
+}
+
+static void pgm_writer_close(struct pgm_writer* w) {
+    if (w->buf) {
+        write_or_die(w->buf, w->used, w->fp, w->filename);
+        pool_put(w->buf, w->buf_size);
+    }
+    fclose(w->fp);
+}
+
+void write_image2(const char* filename, unsigned char* output_image, int M, int N) {
+    struct pgm_writer w;
+
+    printf("  Writing result to disk ...\n");
+
+    pgm_writer_open(&w, filename, M, N);
+    pgm_writer_rows(&w, output_image, M, N);
+    pgm_writer_close(&w);
+}
+
+/*---------------------- Strip Streaming ------------------------------*/
+
+// Bytes fetched per fread by the streaming P2 tokenizer.
+#define STREAM_CHUNK ((size_t)1 << 16)
+
+// The next count input bytes of the image into dst. P5 is read raw, a short
+// file padded with 255 the way getc's EOF was stored; P2 is tokenized from
+// the chunked file source.
+static void stream_read(FILE* finput, int p5, struct byte_source* src, unsigned char* dst, size_t count) {
+    if (p5) {
+        size_t got = fread(dst, 1, count, finput);
+        if (got < count)
+            memset(dst + got, 255, count - got);
+    }
+    else {
+        parse_p2(src, dst, count);
+    }
+}
+
+// Blur and Sobel over an image of any height in strips of S output rows,
+// with memory independent of N. For output rows [r0, r1) Sobel needs blurred
+// rows [r0-1, r1+1), which need input rows [r0-3, r1+3); that input window
+// slides down the file, keeping the 6 rows shared with the previous strip and
+// reading only the new ones, and the 2 blurred rows shared with the previous
+// strip are recomputed. Each finished strip is written straight to the
+// output files, so peak memory is about (3S + 8) * M bytes plus the writer
+// buffers. Output is identical to the in-memory paths; blur_path may be NULL.
+void stream_image(const char* filename, const char* blur_path, const char* edge_path, int M, int N, int S) {
+    FILE* finput = NULL;
+    struct byte_source src = { NULL, 0, 0, NULL, NULL, 0 };
+    struct pgm_writer blur_w, edge_w;
+    size_t in_size = (size_t)(S + 6) * M;
+    size_t blurred_size = (size_t)(S + 2) * M;
+    size_t edge_size = (size_t)S * M;
+    unsigned char *in, *blurred, *edge;
+    const unsigned char* rows[5];
+    const unsigned char* brows[3];
+    int r0, r1, in_lo = 0, in_hi = 0, row, r, p5;
+
+    printf("\nStreaming %s in %d-row strips ...", filename, S);
+    openfile(filename, &finput);
+    p5 = (header[0] == 'P') && (header[1] == '5');
+    if (!p5 && !((header[0] == 'P') && (header[1] == '2'))) {
+        printf("\nProblem with reading the image");
+        exit(EXIT_FAILURE);
+    }
+
+    in = (unsigned char*)pool_get(in_size);
+    blurred = (unsigned char*)pool_get(blurred_size);
+    edge = (unsigned char*)pool_get(edge_size);
+    if (!p5) {
+        src.fp = finput;
+        src.chunk_size = STREAM_CHUNK;
+        src.chunk = (unsigned char*)pool_get(STREAM_CHUNK);
+    }
+    if (!in || !blurred || !edge || (!p5 && !src.chunk)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("\n  Writing result to disk ...\n");
+    if (blur_path)
+        pgm_writer_open(&blur_w, blur_path, M, N);
+    pgm_writer_open(&edge_w, edge_path, M, N);
+
+    for (r0 = 0; r0 < N; r0 = r1) {
+        int lo, hi, b_lo, b_hi;
+
+        r1 = r0 + S < N ? r0 + S : N;
+        lo = r0 - 3 > 0 ? r0 - 3 : 0;
+        hi = r1 + 3 < N ? r1 + 3 : N;
+        b_lo = r0 - 1 > 0 ? r0 - 1 : 0;
+        b_hi = r1 + 1 < N ? r1 + 1 : N;
+
+        // Slide the input window to [lo, hi): keep [lo, in_hi), read the rest.
+        memmove(in, in + (size_t)(lo - in_lo) * M, (size_t)(in_hi - lo) * M);
+        stream_read(finput, p5, &src, in + (size_t)(in_hi - lo) * M, (size_t)(hi - in_hi) * M);
+        in_lo = lo;
+        in_hi = hi;
+
+        for (row = b_lo; row < b_hi; row++) {
+            for (r = 0; r < 5; r++) {
+                int y = row + r - 2;
+                rows[r] = (y < 0 || y >= N) ? NULL : in + (size_t)(y - in_lo) * M;
+            }
+            blur_row(rows, blurred + (size_t)(row - b_lo) * M, M);
+        }
+
+        for (row = r0; row < r1; row++) {
+            unsigned char* out = edge + (size_t)(row - r0) * M;
+
+            if (row == 0 || row == N - 1) {
+                memset(out, 0, M);
+                continue;
+            }
+            for (r = 0; r < 3; r++)
+                brows[r] = blurred + (size_t)(row - 1 + r - b_lo) * M;
+            sobel_row(brows, out, M);
+        }
+
+        if (blur_path)
+            pgm_writer_rows(&blur_w, blurred + (size_t)(r0 - b_lo) * M, M, r1 - r0);
+        pgm_writer_rows(&edge_w, edge, M, r1 - r0);
+    }
+
+    if (blur_path)
+        pgm_writer_close(&blur_w);
+    pgm_writer_close(&edge_w);
+    fclose(finput);
+
+    pool_put(src.chunk, STREAM_CHUNK);
+    pool_put(in, in_size);
+    pool_put(blurred, blurred_size);
+    pool_put(edge, edge_size);
+}
+
+void openfile(const char* filename, FILE** finput) {
+    int x0, y0, x;
+
+    *finput = fopen(filename, "rb");
+    if (*finput == NULL) {
+        fprintf(stderr, "Unable to open file %s for reading\n", filename);
+        exit(-1);
+    }
+
+    fscanf(*finput, "%s", header);
+
+    x0 = getint(*finput); // This is M (width)
+    y0 = getint(*finput); // This is N (height)
+    printf("\t Header is %s, while x=%d, y=%d", header, x0, y0);
+
+    x = getint(*finput); /* Read and throw away the range info */
+}
+
+int getint(FILE* fp) {
+    int c, i, firstchar;
+
+    c = getc(fp);
+    while (1) {
+        if (c == '#') {
+            char cmt[256], *sp;
+            sp = cmt;
+            firstchar = 1;
+            while (1) {
+                c = getc(fp);
+                if (firstchar && c == ' ') firstchar = 0;
+                else {
+                    if (c == '\n' || c == EOF) break;
+                    if ((sp - cmt) < 250) *sp++ = c;
+                }
+            }
+            *sp++ = '\n';
+            *sp = '\0';
+        }
+
+        if (c == EOF) return 0;
+        if (c >= '0' && c <= '9') break;
+
+        c = getc(fp);
+    }
+
+    i = 0;
+    while (1) {
+        i = (i * 10) + (c - '0');
+        c = getc(fp);
+        if (c == EOF) return i;
+        if (c < '0' || c > '9') break;
+    }
+    return i;
+}
@@ -1,206 +1,3790 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-#include <intrin.h>
-#include <chrono>
-#include <iostream>
-#include <omp.h>
-#include <math.h>
-
-// Function declarations
-void initialize(unsigned int M, unsigned int N);
-void routine1(float alpha, float beta, unsigned int M);
-void routine2(float alpha, float beta, unsigned int N);
-void routine1_vec(float alpha, float beta, unsigned int M);
-void routine2_vec(float alpha, float beta, unsigned int N);
-void check_correctness_routine1(float alpha, float beta, unsigned int M);
-void check_correctness_routine2(float alpha, float beta, unsigned int N);
-
-float* y;
-float* z;
-float* y_ref;
-double* x;
-double* w;
-double* w_ref;
-double** A;
-
-int main(int argc, char* argv[]) {
-
-    // Default sizes
-    unsigned int M = 1024 * 512;
-    unsigned int N = 8192;
-
-    // Accept input sizes if provided
-    if (argc == 3) {
-        M = atoi(argv[1]);
-        N = atoi(argv[2]);
-    }
-
-    float alpha = 0.023f, beta = 0.045f;
-    double run_time, start_time;
-    unsigned int t;
-
-    // Allocate memory with alignment
-    y = (float*)_aligned_malloc(M * sizeof(float), 64);
-    z = (float*)_aligned_malloc(M * sizeof(float), 64);
-    y_ref = (float*)_aligned_malloc(M * sizeof(float), 64);
-
-    x = (double*)_aligned_malloc(N * sizeof(double), 64);
-    w = (double*)_aligned_malloc(N * sizeof(double), 64);
-    w_ref = (double*)_aligned_malloc(N * sizeof(double), 64);
-
-    A = (double**)_aligned_malloc(N * sizeof(double*), 64);
-    for (unsigned int i = 0; i < N; i++) {
-        A[i] = (double*)_aligned_malloc(N * sizeof(double), 64);
-    }
-
-    initialize(M, N);
-
-    printf("\nRoutine1:");
-    start_time = omp_get_wtime(); // Start timer
-
-    for (t = 0; t < 1; t++)
-        routine1_vec(alpha, beta, M);
-
-    run_time = omp_get_wtime() - start_time; // End timer
-    printf("\n Time elapsed is %f secs \n", run_time);
-
-    // Check correctness of routine1
-    check_correctness_routine1(alpha, beta, M);
-
-    printf("\nRoutine2:");
-    start_time = omp_get_wtime(); // Start timer
-
-    for (t = 0; t < 1; t++)
-        routine2_vec(alpha, beta, N);
-
-    run_time = omp_get_wtime() - start_time; // End timer
-    printf("\n Time elapsed is %f secs \n", run_time);
-
-    // Check correctness of routine2
-    check_correctness_routine2(alpha, beta, N);
-
-    // Clean up
-    _aligned_free(y);
-    _aligned_free(z);
-    _aligned_free(y_ref);
-    _aligned_free(x);
-    _aligned_free(w);
-    _aligned_free(w_ref);
-    for (unsigned int i = 0; i < N; i++) {
-        _aligned_free(A[i]);
-    }
-    _aligned_free(A);
-
-    return 0;
-}
-
-void initialize(unsigned int M, unsigned int N) {
-
-    unsigned int i, j;
-
-    // Initialize routine2 arrays
-    for (i = 0; i < N; i++)
-        for (j = 0; j < N; j++) {
-            A[i][j] = (i % 99) + (j % 14) + 0.013;
-        }
-
-    // Initialize routine1 arrays
-    for (i = 0; i < N; i++) {
-        x[i] = (i % 19) - 0.01;
-        w[i] = (i % 5) - 0.002;
-        w_ref[i] = w[i];
-    }
-
-    // Initialize routine1 arrays
-    for (i = 0; i < M; i++) {
-        z[i] = (i % 9) - 0.08f;
-        y[i] = (i % 19) + 0.07f;
-        y_ref[i] = y[i];
-    }
-}
-
-void routine1(float alpha, float beta, unsigned int M) {
-
-    unsigned int i;
-
-    for (i = 0; i < M; i++)
-        y_ref[i] = y_ref[i] - alpha + beta - z[i];
-
-}
-
-void routine2(float alpha, float beta, unsigned int N) {
-
-    unsigned int i, j;
-
-    for (i = 0; i < N; i++)
-        for (j = 0; j < N; j++)
-            w_ref[i] += beta * x[j] + alpha * A[i][j] * x[j];
-
-}
-
-void routine1_vec(float alpha, float beta, unsigned int M) {
-
-    unsigned int i;
-    __m128 vec_alpha = _mm_set1_ps(alpha);
-    __m128 vec_beta = _mm_set1_ps(beta);
-
-    for (i = 0; i < M; i += 4) {
-        __m128 vec_y = _mm_loadu_ps(&y[i]);
-        __m128 vec_z = _mm_loadu_ps(&z[i]);
-        __m128 result = _mm_sub_ps(_mm_add_ps(vec_y, vec_beta), _mm_add_ps(vec_alpha, vec_z));
-        _mm_storeu_ps(&y[i], result);
-    }
-}
-
-void routine2_vec(float alpha, float beta, unsigned int N) {
-
-    unsigned int i, j;
-    __m256d vec_alpha = _mm256_set1_pd(alpha);
-    __m256d vec_beta = _mm256_set1_pd(beta);
-
-    for (i = 0; i < N; i++) {
-        double w_sum = 0.0;
-
-        for (j = 0; j < N; j += 4) {
-            __m256d vec_x = _mm256_loadu_pd(&x[j]);
-            __m256d vec_A = _mm256_loadu_pd(&A[i][j]);
-            __m256d mul1 = _mm256_mul_pd(vec_beta, vec_x);
-            __m256d mul2 = _mm256_mul_pd(vec_alpha, _mm256_mul_pd(vec_A, vec_x));
-            __m256d vec_result = _mm256_add_pd(mul1, mul2);
-
-            // Sum up elements in vec_result
-            w_sum += vec_result.m256d_f64[0] + vec_result.m256d_f64[1] + vec_result.m256d_f64[2] + vec_result.m256d_f64[3];
-        }
-
-        w[i] += w_sum;
-    }
-}
-
-void check_correctness_routine1(float alpha, float beta, unsigned int M) {
-
-    routine1(alpha, beta, M);
-
-    for (unsigned int i = 0; i < M; i++) {
-        if (fabs(y[i] - y_ref[i]) > 1e-6) {
-            printf("\nRoutine1_vec failed at index %d: y_vec=%f, y_ref=%f\n", i, y[i], y_ref[i]);
-            return;
-        }
-    }
-
-    printf("\nRoutine1_vec passed the correctness test!\n");
-}
-
-void check_correctness_routine2(float alpha, float beta, unsigned int N) {
-
-    routine2(alpha, beta, N);
-
-    for (unsigned int i = 0; i < N; i++) {
-        if (fabs(w[i] - w_ref[i]) > 1e-6) {
-            printf("\nRoutine2_vec failed at index %d: w_vec=%f, w_ref=%f\n", i, w[i], w_ref[i]);
-            return;
-        }
-    }
-
-    printf("\nRoutine2_vec passed the correctness test!\n");
-}
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#include <windows.h>
+#else
+#include <immintrin.h>
+#include <cpuid.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#endif
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+#include <math.h>
+
+// Options for the benchmark mode (--bench)
+struct bench_options {
+    bool enabled;
+    bool sweep;        // Run over a range of sizes instead of the given M and N
+    int warmup;        // Untimed calls before measuring
+    int reps;          // Timed calls per routine and size
+    const char* format; // "text", "json" or "csv"
+    const char* out;   // Output file, or NULL for stdout
+};
+
+// A single aligned region that all arrays are carved out of
+struct arena {
+    char* base;       // Start of the usable, 2 MB aligned region
+    size_t size;      // Usable bytes
+    size_t used;      // Bytes handed out so far
+    void* mapping;    // What was actually mapped (may start below base)
+    size_t mapped;    // Bytes actually mapped
+    const char* pages; // "explicit huge", "transparent huge" or "4 KB"
+};
+
+// Storage type of the matrix used by routine2_par
+enum matrix_precision { PREC_FP64, PREC_FP32, PREC_BF16 };
+
+// How routine2_par sums each row
+enum reduction_mode {
+    REDUCE_FAST,         // Order depends on the kernel, the thread split and the tuning
+    REDUCE_DETERMINISTIC // Fixed order, bit-identical for any thread count and instruction set
+};
+
+// How check_correctness_routine1/2 obtain their reference output
+enum verify_mode {
+    VERIFY_FULL,   // Rerun the scalar routine over every element
+    VERIFY_SAMPLE, // Scalar reference for verify_samples random elements/rows
+    VERIFY_GOLDEN  // Compare every element with a stored output, creating it if missing
+};
+
+// Parameters chosen by --autotune and stored in the per-host profile
+struct tune_params {
+    int r2_jblock;       // Columns of x per block in routine2_par
+    int r2_rowblock;     // Rows per block in routine2_par (0: a thread's whole share at once)
+    int r2_accumulators; // Accumulators per row in the fp64 routine2 kernel (0: built-in four-row kernel)
+    int r2_threads;      // Threads used by routine2_par (0: OpenMP default)
+    int r1_threads;      // Threads used by routine1_par (0: OpenMP default)
+};
+
+// Read-only mapping of a matrix file used by the out-of-core routine2
+struct mapped_matrix {
+    const double* data; // n x n row-major doubles, row stride n
+    uint64_t n;
+    uint64_t bytes;     // File size, n * n * sizeof(double)
+#if defined(_MSC_VER)
+    HANDLE file;
+    HANDLE mapping;
+#else
+    int fd;
+#endif
+};
+
+// Function declarations
+bool arena_create(arena* a, size_t bytes);
+void* arena_alloc(arena* a, size_t bytes, size_t alignment);
+void arena_destroy(arena* a);
+void allocate_arrays(unsigned int M, unsigned int N);
+void free_arrays();
+void initialize(unsigned int M, unsigned int N);
+void routine1(float alpha, float beta, unsigned int M);
+void routine2(float alpha, float beta, unsigned int N);
+void routine1_vec(float alpha, float beta, unsigned int M);
+void routine2_vec(float alpha, float beta, unsigned int N);
+void routine1_par(float alpha, float beta, unsigned int M);
+void routine2_par(float alpha, float beta, unsigned int N);
+void routine1_share(float alpha, float beta, unsigned int M, int tid, int nthreads);
+bool routine1_streams(unsigned int M);
+void routine2_share(float alpha, float beta, unsigned int N, int tid, int nthreads);
+void routine2_det(float alpha, float beta, unsigned int N);
+void routine1_steps(float alpha, float beta, unsigned int M, int steps);
+void routine2_steps(float alpha, float beta, unsigned int N, int steps);
+int run_steps(unsigned int M, unsigned int N, float alpha, float beta, int steps);
+void compare_reductions(float alpha, float beta, unsigned int N, double det_time);
+void routine1_fused(float alpha, float beta, unsigned int M);
+void routine2_fused(float alpha, float beta, unsigned int N);
+void routine2_batch(float alpha, float beta, unsigned int N, unsigned int K, const double* const* X, double* const* W);
+void select_kernels();
+const char* precision_name(matrix_precision p);
+static inline uint16_t float_to_bf16(float f);
+size_t matrix_element_size(matrix_precision p);
+size_t llc_size();
+double measure_stream_peak();
+void check_correctness_routine1(float alpha, float beta, unsigned int M);
+void check_correctness_routine2(float alpha, float beta, unsigned int N);
+void run_routine2_batch(float alpha, float beta, unsigned int N, unsigned int K);
+bool numa_setup();
+void numa_place_arrays(unsigned int M, unsigned int N);
+void numa_replicate_x(unsigned int N);
+void numa_free_arrays();
+void numa_report(unsigned int N);
+bool matrix_map(const char* path, mapped_matrix* m);
+void matrix_unmap(mapped_matrix* m);
+uint64_t ooc_block_rows(uint64_t n);
+void routine2_ooc(float alpha, float beta, const mapped_matrix* m, const double* xv, double* wv, double* sums);
+bool write_matrix_file(const char* path, unsigned int n);
+int run_routine2_mapped(const char* path, float alpha, float beta);
+void apply_tuning();
+bool load_tuning(unsigned int M, unsigned int N);
+int run_autotune(unsigned int M, unsigned int N, float alpha, float beta);
+int run_concurrent(unsigned int M, unsigned int N, float alpha, float beta);
+int run_benchmarks(const bench_options* opt, unsigned int M, unsigned int N, float alpha, float beta);
+int run_counters(unsigned int M, unsigned int N, float alpha, float beta);
+
+float* y;
+float* z;
+float* y_ref;
+double* x;
+double* w;
+double* w_ref;
+double* w_part;   // routine2 partial sums, w_part_width per row; each thread only touches its own rows
+double** A;       // Row view of A_data (A[i] = A_data + i * lda)
+double* A_data;   // Contiguous row-major storage for A
+size_t lda;       // Row stride of A_data in doubles, padded to a multiple of 64 bytes
+float* A_f32;     // A rounded to float when a_precision is PREC_FP32 (same lda)
+uint16_t* A_bf16; // A rounded to bfloat16 when a_precision is PREC_BF16 (same lda)
+matrix_precision a_precision = PREC_FP64;
+reduction_mode r2_reduction = REDUCE_FAST;
+verify_mode verify = VERIFY_SAMPLE;
+unsigned int verify_samples = 256; // Elements/rows checked by VERIFY_SAMPLE
+const char* golden_dir = ".";      // Directory holding VERIFY_GOLDEN outputs
+const char* kernel_isa = "SSE4.2"; // Instruction set picked by select_kernels()
+int kernel_level = 0;              // Same choice as a number: 0 SSE4.2, 1 AVX2+FMA, 2 AVX-512
+bool numa_mode = false;            // Pin threads and place data per NUMA node (--numa)
+const char* tune_profile = NULL;   // Tuning profile (--profile), question_1.<host>.tune by default
+unsigned int w_part_width = 1;     // Sums per row in w_part: the --batch size when batching, else 1
+arena data_arena; // Backing storage for all of the arrays above
+
+#define HUGE_PAGE_SIZE (2u * 1024 * 1024)
+
+#if !defined(_MSC_VER)
+// _aligned_malloc/_aligned_free are MSVC-only; map them onto posix_memalign elsewhere
+static inline void* _aligned_malloc(size_t size, size_t alignment) {
+    void* p = NULL;
+    return posix_memalign(&p, alignment, size) == 0 ? p : NULL;
+}
+
+static inline void _aligned_free(void* p) {
+    free(p);
+}
+#endif
+
+// Blocking parameter for routine2_par
+#define R2_JBLOCK 1024 // Columns of x per block (8 KB, stays resident in L1)
+
+tune_params tuning = { R2_JBLOCK, 0, 0, 0, 0 }; // Defaults until a profile is loaded
+
+// Per-function instruction set targets for the dispatched kernels. MSVC emits
+// any intrinsic regardless of /arch, so nothing is needed there.
+#if defined(_MSC_VER)
+#define TARGET_SSE42
+#define TARGET_AVX2
+#define TARGET_AVX512
+#define FLATTEN
+#define NOINLINE __declspec(noinline)
+#define NO_CONTRACT
+#else
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define FLATTEN __attribute__((flatten))
+#define NOINLINE __attribute__((noinline))
+#if defined(__clang__)
+#define NO_CONTRACT // Clang only fuses within one source expression
+#else
+#define NO_CONTRACT __attribute__((optimize("fp-contract=off")))
+#endif
+#endif
+
+int main(int argc, char* argv[]) {
+
+    // Default sizes
+    unsigned int M = 1024 * 512;
+    unsigned int N = 8192;
+
+    bench_options bench = { false, false, 3, 20, "text", NULL };
+    unsigned int batch = 0;
+    bool counters = false;
+    bool autotune = false;
+    bool concurrent = false;
+    int steps = 0;
+    const char* matrix_file = NULL;  // Run routine2 out-of-core on this file
+    const char* write_matrix = NULL; // Write the N x N matrix to this file first
+    int positional = 0;
+
+    // Accept input sizes (M N) and benchmark options if provided
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--bench") == 0)
+            bench.enabled = true;
+        else if (strcmp(argv[a], "--sweep") == 0)
+            bench.enabled = bench.sweep = true;
+        else if (strcmp(argv[a], "--warmup") == 0 && a + 1 < argc)
+            bench.warmup = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--reps") == 0 && a + 1 < argc)
+            bench.reps = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--format") == 0 && a + 1 < argc)
+            bench.format = argv[++a];
+        else if (strcmp(argv[a], "--out") == 0 && a + 1 < argc)
+            bench.out = argv[++a];
+        else if (strcmp(argv[a], "--verify") == 0 && a + 1 < argc) {
+            const char* v = argv[++a];
+            if (strcmp(v, "full") == 0)
+                verify = VERIFY_FULL;
+            else if (strcmp(v, "sample") == 0)
+                verify = VERIFY_SAMPLE;
+            else if (strcmp(v, "golden") == 0)
+                verify = VERIFY_GOLDEN;
+            else {
+                fprintf(stderr, "Unknown verification mode %s\n", v);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "--samples") == 0 && a + 1 < argc)
+            verify_samples = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--golden-dir") == 0 && a + 1 < argc)
+            golden_dir = argv[++a];
+        else if (strcmp(argv[a], "--counters") == 0)
+            counters = true;
+        else if (strcmp(argv[a], "--batch") == 0 && a + 1 < argc)
+            batch = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--autotune") == 0)
+            autotune = true;
+        else if (strcmp(argv[a], "--reduction") == 0 && a + 1 < argc) {
+            const char* r = argv[++a];
+            if (strcmp(r, "fast") == 0)
+                r2_reduction = REDUCE_FAST;
+            else if (strcmp(r, "deterministic") == 0)
+                r2_reduction = REDUCE_DETERMINISTIC;
+            else {
+                fprintf(stderr, "Unknown reduction mode %s\n", r);
+                return 1;
+            }
+        }
+        else if (strcmp(argv[a], "--steps") == 0 && a + 1 < argc)
+            steps = atoi(argv[++a]);
+        else if (strcmp(argv[a], "--concurrent") == 0)
+            concurrent = true;
+        else if (strcmp(argv[a], "--profile") == 0 && a + 1 < argc)
+            tune_profile = argv[++a];
+        else if (strcmp(argv[a], "--numa") == 0)
+            numa_mode = true;
+        else if (strcmp(argv[a], "--matrix") == 0 && a + 1 < argc)
+            matrix_file = argv[++a];
+        else if (strcmp(argv[a], "--write-matrix") == 0 && a + 1 < argc)
+            write_matrix = argv[++a];
+        else if (strcmp(argv[a], "--precision") == 0 && a + 1 < argc) {
+            const char* p = argv[++a];
+            if (strcmp(p, "fp64") == 0)
+                a_precision = PREC_FP64;
+            else if (strcmp(p, "fp32") == 0)
+                a_precision = PREC_FP32;
+            else if (strcmp(p, "bf16") == 0)
+                a_precision = PREC_BF16;
+            else {
+                fprintf(stderr, "Unknown matrix precision %s\n", p);
+                return 1;
+            }
+        }
+        else if (argv[a][0] != '-' && positional == 0) {
+            M = atoi(argv[a]);
+            positional++;
+        }
+        else if (argv[a][0] != '-' && positional == 1) {
+            N = atoi(argv[a]);
+            positional++;
+        }
+        else {
+            fprintf(stderr, "Usage: %s [M N] [--bench] [--sweep] [--warmup W] [--reps R] "
+                            "[--format text|json|csv] [--out file] [--precision fp64|fp32|bf16] [--batch K] "
+                            "[--reduction fast|deterministic] "
+                            "[--autotune] [--profile file] [--concurrent] [--steps T] [--numa] [--matrix file] [--write-matrix file] [--verify full|sample|golden] [--samples R] [--golden-dir dir] [--counters]\n", argv[0]);
+            return 1;
+        }
+    }
+    // Without --batch the partial sums need one slot per row
+    w_part_width = batch > 0 ? batch : 1;
+    if (positional == 1 || bench.reps < 1 || bench.warmup < 0) {
+        fprintf(stderr, "Both M and N must be given, and --reps must be at least 1\n");
+        return 1;
+    }
+    if (r2_reduction == REDUCE_DETERMINISTIC && a_precision != PREC_FP64) {
+        fprintf(stderr, "--reduction deterministic needs the fp64 matrix\n");
+        return 1;
+    }
+
+    float alpha = 0.023f, beta = 0.045f;
+    double run_time, start_time;
+    unsigned int t;
+
+    select_kernels();
+    if (numa_mode)
+        numa_mode = numa_setup();
+    if (autotune)
+        return run_autotune(M, N, alpha, beta);
+    load_tuning(M, N);
+
+    if (write_matrix && !write_matrix_file(write_matrix, N))
+        return 1;
+    if (matrix_file)
+        return run_routine2_mapped(matrix_file, alpha, beta);
+    if (write_matrix)
+        return 0;
+    if (bench.enabled)
+        return run_benchmarks(&bench, M, N, alpha, beta);
+    if (counters)
+        return run_counters(M, N, alpha, beta);
+    if (concurrent)
+        return run_concurrent(M, N, alpha, beta);
+    if (steps > 0)
+        return run_steps(M, N, alpha, beta, steps);
+
+    allocate_arrays(M, N);
+
+    start_time = omp_get_wtime(); // Start timer
+    initialize(M, N);
+    run_time = omp_get_wtime() - start_time; // End timer
+
+    printf("\nUsing %s kernels, %.1f MB arena on %s pages", kernel_isa,
+           data_arena.size / (1024.0 * 1024.0), data_arena.pages);
+    printf("\nInitialization (%d threads):\n Time elapsed is %f secs \n", omp_get_max_threads(), run_time);
+
+    printf("\nRoutine1 (%d threads):", omp_get_max_threads());
+    start_time = omp_get_wtime(); // Start timer
+
+    for (t = 0; t < 1; t++)
+        routine1_par(alpha, beta, M);
+
+    run_time = omp_get_wtime() - start_time; // End timer
+    printf("\n Time elapsed is %f secs \n", run_time);
+
+    // y and z are read and y is written once per call. Only when they do not
+    // fit in the LLC is the figure DRAM bandwidth comparable to STREAM.
+    double bandwidth = 3.0 * sizeof(float) * M / run_time * 1e-9;
+    if (routine1_streams(M)) {
+        double peak = measure_stream_peak();
+        printf(" Bandwidth %.2f GB/s, %.0f%% of the %.2f GB/s STREAM triad peak \n",
+               bandwidth, 100.0 * bandwidth / peak, peak);
+    }
+    else
+        printf(" Bandwidth %.2f GB/s (y and z fit in the LLC, so this is cache bandwidth) \n", bandwidth);
+
+    // Check correctness of routine1
+    check_correctness_routine1(alpha, beta, M);
+
+    printf("\nRoutine2 (%d threads, %s matrix%s):", omp_get_max_threads(), precision_name(a_precision),
+           r2_reduction == REDUCE_DETERMINISTIC ? ", deterministic reduction" : "");
+    start_time = omp_get_wtime(); // Start timer
+
+    for (t = 0; t < 1; t++)
+        routine2_par(alpha, beta, N);
+
+    run_time = omp_get_wtime() - start_time; // End timer
+    printf("\n Time elapsed is %f secs \n", run_time);
+
+    // Check correctness of routine2
+    check_correctness_routine2(alpha, beta, N);
+    if (numa_mode)
+        numa_report(N);
+    if (r2_reduction == REDUCE_DETERMINISTIC)
+        compare_reductions(alpha, beta, N, run_time);
+
+    if (batch > 0)
+        run_routine2_batch(alpha, beta, N, batch);
+
+    // Clean up
+    free_arrays();
+
+    return 0;
+}
+
+/*---------------------------- Memory system probes ---------------------------*/
+
+// Size of the last level cache in bytes, or 32 MB if it cannot be determined
+size_t llc_size() {
+
+    static size_t cached = 0;
+    if (cached)
+        return cached;
+
+#if defined(_MSC_VER)
+    DWORD len = 0;
+    GetLogicalProcessorInformation(NULL, &len);
+    std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION) + 1);
+    if (GetLogicalProcessorInformation(info.data(), &len)) {
+        for (size_t k = 0; k < len / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); k++) {
+            if (info[k].Relationship == RelationCache && info[k].Cache.Level >= 2 && info[k].Cache.Size > cached)
+                cached = info[k].Cache.Size;
+        }
+    }
+#elif defined(_SC_LEVEL3_CACHE_SIZE)
+    long l3 = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    cached = l3 > 0 ? (size_t)l3 : (l2 > 0 ? (size_t)l2 : 0);
+#endif
+
+    if (cached == 0)
+        cached = 32u * 1024 * 1024;
+    return cached;
+}
+
+// STREAM-style triad a = b + s * c on all threads over arrays four times the
+// size of the LLC (at least 32 MB each). Returns the best of five runs in GB/s,
+// counting 24 bytes per element as STREAM does.
+double measure_stream_peak() {
+
+    size_t bytes = 4 * llc_size() > 32u * 1024 * 1024 ? 4 * llc_size() : 32u * 1024 * 1024;
+    long n = (long)(bytes / sizeof(double));
+    double* a = (double*)_aligned_malloc(n * sizeof(double), 64);
+    double* b = (double*)_aligned_malloc(n * sizeof(double), 64);
+    double* c = (double*)_aligned_malloc(n * sizeof(double), 64);
+    double best = 0.0;
+
+    if (!a || !b || !c) {
+        _aligned_free(a);
+        _aligned_free(b);
+        _aligned_free(c);
+        return 0.0;
+    }
+
+#pragma omp parallel for schedule(static)
+    for (long k = 0; k < n; k++) {
+        a[k] = 0.0;
+        b[k] = 1.0;
+        c[k] = 2.0;
+    }
+
+    for (int rep = 0; rep < 5; rep++) {
+        double start_time = omp_get_wtime();
+
+#pragma omp parallel for schedule(static)
+        for (long k = 0; k < n; k++)
+            a[k] = b[k] + 3.0 * c[k];
+
+        double run_time = omp_get_wtime() - start_time;
+        double rate = 3.0 * sizeof(double) * n / run_time * 1e-9;
+        if (rate > best)
+            best = rate;
+    }
+
+    _aligned_free(a);
+    _aligned_free(b);
+    _aligned_free(c);
+    return best;
+}
+
+/*------------------------------ Arena allocator ------------------------------*/
+
+static size_t round_up(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+}
+
+// Reserve and commit `bytes` of memory in one region, backed by huge pages when
+// the OS allows it. Tries explicit huge pages first (hugetlbfs on Linux, large
+// pages on Windows), then transparent huge pages, then normal pages.
+bool arena_create(arena* a, size_t bytes) {
+
+    a->size = round_up(bytes > 0 ? bytes : 1, HUGE_PAGE_SIZE);
+    a->used = 0;
+
+#if defined(_MSC_VER)
+    SIZE_T large = GetLargePageMinimum();
+    a->mapping = NULL;
+    if (large > 0) {
+        a->mapped = round_up(a->size, large);
+        a->mapping = VirtualAlloc(NULL, a->mapped, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        a->pages = "explicit huge";
+    }
+    if (a->mapping == NULL) {
+        a->mapped = a->size;
+        a->mapping = VirtualAlloc(NULL, a->mapped, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        a->pages = "4 KB";
+    }
+    a->base = (char*)a->mapping;
+#else
+    a->mapped = a->size;
+    a->mapping = mmap(NULL, a->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    a->pages = "explicit huge";
+
+    if (a->mapping == MAP_FAILED) {
+        // Over-allocate by one huge page so the region can start on a 2 MB boundary
+        a->mapped = a->size + HUGE_PAGE_SIZE;
+        a->mapping = mmap(NULL, a->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (a->mapping == MAP_FAILED)
+            a->mapping = NULL;
+        a->pages = "4 KB";
+#ifdef MADV_HUGEPAGE
+        if (a->mapping && madvise(a->mapping, a->mapped, MADV_HUGEPAGE) == 0)
+            a->pages = "transparent huge";
+#endif
+    }
+    a->base = a->mapping ? (char*)round_up((size_t)a->mapping, HUGE_PAGE_SIZE) : NULL;
+#endif
+
+    return a->mapping != NULL;
+}
+
+// Hand out the next `bytes` of the arena at the given (power of two) alignment
+void* arena_alloc(arena* a, size_t bytes, size_t alignment) {
+
+    size_t offset = round_up(a->used, alignment);
+    if (offset + bytes > a->size)
+        return NULL;
+
+    a->used = offset + bytes;
+    return a->base + offset;
+}
+
+void arena_destroy(arena* a) {
+
+    if (a->mapping == NULL)
+        return;
+#if defined(_MSC_VER)
+    VirtualFree(a->mapping, 0, MEM_RELEASE);
+#else
+    munmap(a->mapping, a->mapped);
+#endif
+    a->mapping = NULL;
+    a->base = NULL;
+}
+
+void allocate_arrays(unsigned int M, unsigned int N) {
+
+    // A is stored in one contiguous buffer; the row pointers are only a view into it
+    lda = ((size_t)N + 7) & ~(size_t)7;
+
+    size_t matrix_bytes = (size_t)N * lda * sizeof(double);
+    size_t float_bytes = round_up((size_t)M * sizeof(float), 64);
+    size_t double_bytes = round_up((size_t)N * sizeof(double), 64);
+    size_t rows_bytes = round_up((size_t)N * sizeof(double*), 64);
+    size_t reduced_bytes = a_precision == PREC_FP64 ? 0 : round_up((size_t)N * lda * matrix_element_size(a_precision), 64);
+    size_t part_bytes = round_up((size_t)N * w_part_width * sizeof(double), 64);
+
+    // The matrix goes first so it starts on a huge page boundary
+    if (!arena_create(&data_arena, round_up(matrix_bytes, 64) + reduced_bytes + 3 * float_bytes + 3 * double_bytes + part_bytes + rows_bytes)) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    A_data = (double*)arena_alloc(&data_arena, matrix_bytes, 64);
+    A_f32 = a_precision == PREC_FP32 ? (float*)arena_alloc(&data_arena, reduced_bytes, 64) : NULL;
+    A_bf16 = a_precision == PREC_BF16 ? (uint16_t*)arena_alloc(&data_arena, reduced_bytes, 64) : NULL;
+
+    y = (float*)arena_alloc(&data_arena, float_bytes, 64);
+    z = (float*)arena_alloc(&data_arena, float_bytes, 64);
+    y_ref = (float*)arena_alloc(&data_arena, float_bytes, 64);
+
+    x = (double*)arena_alloc(&data_arena, double_bytes, 64);
+    w = (double*)arena_alloc(&data_arena, double_bytes, 64);
+    w_ref = (double*)arena_alloc(&data_arena, double_bytes, 64);
+    w_part = (double*)arena_alloc(&data_arena, part_bytes, 64);
+
+    // Compatibility view for code that indexes A[i][j]
+    A = (double**)arena_alloc(&data_arena, rows_bytes, 64);
+    for (unsigned int i = 0; i < N; i++) {
+        A[i] = A_data + (size_t)i * lda;
+    }
+
+    if (numa_mode)
+        numa_place_arrays(M, N);
+}
+
+void free_arrays() {
+
+    numa_free_arrays();
+    arena_destroy(&data_arena);
+    y = z = y_ref = NULL;
+    x = w = w_ref = w_part = A_data = NULL;
+    A = NULL;
+    A_f32 = NULL;
+    A_bf16 = NULL;
+}
+
+// Static split of n elements across nthreads, with every boundary on a
+// multiple of `align` elements. initialize() and the parallel routines use the
+// same split so each thread works on the pages it touched first.
+static void thread_range(size_t n, size_t align, int tid, int nthreads, size_t* begin, size_t* end) {
+
+    size_t chunk = (n + nthreads - 1) / nthreads;
+    chunk = (chunk + align - 1) / align * align;
+    *begin = (size_t)tid * chunk < n ? (size_t)tid * chunk : n;
+    *end = *begin + chunk < n ? *begin + chunk : n;
+}
+
+/*------------------------------ NUMA placement -------------------------------*/
+// With --numa each OpenMP thread is pinned to one CPU, and threads are assigned
+// to NUMA nodes in contiguous groups. Each thread's share of A and of y/z, as
+// split by thread_range(), is bound to that thread's node with mbind, and
+// routine2_par reads a per-node copy of x. The raw system calls are used so
+// libnuma is not needed.
+
+#if defined(__linux__)
+#ifndef MPOL_BIND
+#define MPOL_BIND 2
+#endif
+#ifndef MPOL_MF_MOVE
+#define MPOL_MF_MOVE (1 << 1)
+#endif
+#define NUMA_MAX_NODES 1024
+#endif
+
+static std::vector<int> numa_thread_node; // Node of each OpenMP thread, set by numa_setup()
+static std::vector<double*> x_node;       // Replica of x on each node (indexed by node id)
+static size_t x_node_bytes;
+
+#if defined(__linux__)
+// Parse a sysfs list such as "0-3,8-11"
+static std::vector<int> parse_id_list(const char* text) {
+
+    std::vector<int> ids;
+    const char* p = text;
+
+    while (true) {
+        char* e;
+        long first = strtol(p, &e, 10);
+        if (e == p)
+            break;
+        long last = first;
+        if (*e == '-') {
+            p = e + 1;
+            last = strtol(p, &e, 10);
+        }
+        for (long i = first; i <= last; i++)
+            ids.push_back((int)i);
+        if (*e != ',')
+            break;
+        p = e + 1;
+    }
+    return ids;
+}
+
+static bool read_text_file(const char* path, char* buf, size_t len) {
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+    bool ok = fgets(buf, (int)len, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// Bind the pages in [p, p + bytes) to node, moving any that were already
+// touched. Both ends are rounded up to a page boundary, so consecutive ranges
+// bind every page exactly once.
+static void numa_bind(void* p, size_t bytes, int node, size_t page) {
+
+    uintptr_t start = round_up((uintptr_t)p, page);
+    uintptr_t end = round_up((uintptr_t)p + bytes, page);
+    if (end <= start)
+        return;
+
+    unsigned long mask[NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    mask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+    syscall(SYS_mbind, start, end - start, MPOL_BIND, mask, (unsigned long)NUMA_MAX_NODES, MPOL_MF_MOVE);
+}
+
+// Bind every thread's part of an array of n elements, split the way
+// thread_range(n, align) splits it, to that thread's node
+static void numa_bind_split(void* base, size_t element_bytes, size_t n, size_t align, size_t page) {
+
+    const int nthreads = (int)numa_thread_node.size();
+    for (int t = 0; t < nthreads; t++) {
+        size_t begin, end;
+        thread_range(n, align, t, nthreads, &begin, &end);
+        if (begin < end)
+            numa_bind((char*)base + begin * element_bytes, (end - begin) * element_bytes, numa_thread_node[t], page);
+    }
+}
+#endif
+
+// Discover the nodes and their usable CPUs, assign the OpenMP threads to
+// nodes and pin them. Returns false (and leaves threads unpinned) when the
+// topology cannot be read.
+bool numa_setup() {
+
+#if defined(__linux__)
+    char buf[4096], path[128];
+    cpu_set_t allowed;
+
+    if (!read_text_file("/sys/devices/system/node/online", buf, sizeof(buf)) ||
+        sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "NUMA topology is not available, running without --numa\n");
+        return false;
+    }
+
+    // Nodes with at least one CPU this process may run on
+    std::vector<int> nodes;
+    std::vector<std::vector<int> > node_cpus;
+    std::vector<int> online = parse_id_list(buf);
+    for (size_t k = 0; k < online.size(); k++) {
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", online[k]);
+        if (online[k] >= NUMA_MAX_NODES || !read_text_file(path, buf, sizeof(buf)))
+            continue;
+        std::vector<int> cpus = parse_id_list(buf), usable;
+        for (size_t c = 0; c < cpus.size(); c++)
+            if (cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed))
+                usable.push_back(cpus[c]);
+        if (!usable.empty()) {
+            nodes.push_back(online[k]);
+            node_cpus.push_back(usable);
+        }
+    }
+    if (nodes.empty()) {
+        fprintf(stderr, "No usable NUMA nodes found, running without --numa\n");
+        return false;
+    }
+
+    // Thread t goes to node group t * nodes / threads, so each node gets a
+    // contiguous run of threads and therefore a contiguous block of rows
+    const int nthreads = omp_get_max_threads();
+    const int nnodes = (int)nodes.size();
+    std::vector<int> thread_cpu(nthreads);
+    numa_thread_node.resize(nthreads);
+    for (int t = 0; t < nthreads; t++) {
+        int k = (int)((long long)t * nnodes / nthreads);
+        int first = (int)(((long long)k * nthreads + nnodes - 1) / nnodes);
+        numa_thread_node[t] = nodes[k];
+        thread_cpu[t] = node_cpus[k][(t - first) % node_cpus[k].size()];
+    }
+
+#pragma omp parallel num_threads(nthreads)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(thread_cpu[omp_get_thread_num()], &set);
+        sched_setaffinity(0, sizeof(set), &set);
+    }
+
+    printf("\nNUMA mode: %d threads pinned across %d nodes:", nthreads, nnodes);
+    for (int k = 0, t = 0; k < nnodes; k++) {
+        int first = t;
+        while (t < nthreads && numa_thread_node[t] == nodes[k])
+            t++;
+        printf(" node %d threads %d-%d%s", nodes[k], first, t - 1, k + 1 < nnodes ? ";" : "");
+    }
+    return true;
+#else
+    fprintf(stderr, "--numa is only supported on Linux, running without it\n");
+    return false;
+#endif
+}
+
+// Called by allocate_arrays() in NUMA mode, before initialize() touches anything
+void numa_place_arrays(unsigned int M, unsigned int N) {
+
+#if defined(__linux__)
+    const size_t page = strcmp(data_arena.pages, "explicit huge") == 0 ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+
+    numa_bind_split(A_data, lda * sizeof(double), N, 1, page);
+    if (A_f32)
+        numa_bind_split(A_f32, lda * sizeof(float), N, 1, page);
+    if (A_bf16)
+        numa_bind_split(A_bf16, lda * sizeof(uint16_t), N, 1, page);
+    numa_bind_split(y, sizeof(float), M, 16, page);
+    numa_bind_split(z, sizeof(float), M, 16, page);
+    numa_bind_split(y_ref, sizeof(float), M, 16, page);
+    numa_bind_split(w_part, w_part_width * sizeof(double), N, 1, page);
+
+    // One copy of x per node, filled by routine2_par
+    x_node_bytes = round_up((size_t)N * sizeof(double), (size_t)sysconf(_SC_PAGESIZE));
+    x_node.assign(NUMA_MAX_NODES, NULL);
+    for (size_t t = 0; t < numa_thread_node.size(); t++) {
+        int node = numa_thread_node[t];
+        if (x_node[node] != NULL)
+            continue;
+        void* p = mmap(NULL, x_node_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(EXIT_FAILURE);
+        }
+        numa_bind(p, x_node_bytes, node, (size_t)sysconf(_SC_PAGESIZE));
+        x_node[node] = (double*)p;
+    }
+#else
+    (void)M;
+    (void)N;
+#endif
+}
+
+// Copy x to the replica on every node used by the threads
+void numa_replicate_x(unsigned int N) {
+
+    for (size_t k = 0; k < x_node.size(); k++)
+        if (x_node[k])
+            memcpy(x_node[k], x, N * sizeof(double));
+}
+
+void numa_free_arrays() {
+
+#if defined(__linux__)
+    for (size_t k = 0; k < x_node.size(); k++)
+        if (x_node[k])
+            munmap(x_node[k], x_node_bytes);
+#endif
+    x_node.clear();
+}
+
+// Report where the pages of the matrix routine2_par streams actually are,
+// relative to the node of the thread that reads them
+void numa_report(unsigned int N) {
+
+#if defined(__linux__)
+    const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    const size_t row_bytes = lda * matrix_element_size(a_precision);
+    const char* base = a_precision == PREC_FP32 ? (const char*)A_f32
+                     : (a_precision == PREC_BF16 ? (const char*)A_bf16 : (const char*)A_data);
+    const int nthreads = (int)numa_thread_node.size();
+    unsigned long long local = 0, remote = 0, absent = 0;
+
+    for (int t = 0; t < nthreads; t++) {
+        size_t begin, end;
+        thread_range(N, 1, t, nthreads, &begin, &end);
+        if (begin >= end)
+            continue;
+
+        // move_pages with no target nodes only reports each page's node
+        std::vector<void*> pages;
+        for (uintptr_t p = (uintptr_t)(base + begin * row_bytes) / page * page; p < (uintptr_t)(base + end * row_bytes); p += page)
+            pages.push_back((void*)p);
+        std::vector<int> status(pages.size());
+        if (syscall(SYS_move_pages, 0, pages.size(), pages.data(), NULL, status.data(), 0) != 0)
+            continue;
+
+        for (size_t k = 0; k < status.size(); k++) {
+            if (status[k] < 0)
+                absent++;
+            else if (status[k] == numa_thread_node[t])
+                local++;
+            else
+                remote++;
+        }
+    }
+
+    printf("\n NUMA: %llu local, %llu remote, %llu unmapped pages of the %s matrix (%.1f%% local); x replicated per node\n",
+           local, remote, absent, precision_name(a_precision),
+           local + remote > 0 ? 100.0 * local / (local + remote) : 0.0);
+#else
+    (void)N;
+#endif
+}
+
+/*------------------- Initialization and reference routines -------------------*/
+
+// Write one row of A: row[j] = (row_term + col_term[j]) + 0.013. row_term and
+// col_term hold the integer parts i % 99 and j % 14, whose sum is exact in
+// double, so this matches the original (i % 99) + (j % 14) + 0.013 bit for bit.
+// With stream set the row is written with non-temporal stores (row must be
+// 16-byte aligned), which skips reading the destination lines into cache.
+static void initialize_matrix_row(double* row, const double* col_term, double row_term, unsigned int N, bool stream) {
+
+    __m128d vec_row = _mm_set1_pd(row_term);
+    __m128d vec_c = _mm_set1_pd(0.013);
+    unsigned int j = 0;
+
+    if (stream) {
+        for (; j + 2 <= N; j += 2)
+            _mm_stream_pd(&row[j], _mm_add_pd(_mm_add_pd(vec_row, _mm_loadu_pd(&col_term[j])), vec_c));
+    }
+    else {
+        for (; j + 2 <= N; j += 2)
+            _mm_storeu_pd(&row[j], _mm_add_pd(_mm_add_pd(vec_row, _mm_loadu_pd(&col_term[j])), vec_c));
+    }
+
+    for (; j < N; j++)
+        row[j] = (row_term + col_term[j]) + 0.013;
+}
+
+// Fills all arrays in parallel. Every thread initializes exactly the rows of A
+// and the slice of y/z that routine2_par and routine1_par later assign to it,
+// so on NUMA hosts the pages are placed on that thread's node. The modulo
+// terms are read from small tables instead of being computed per element.
+void initialize(unsigned int M, unsigned int N) {
+
+    unsigned int i, j;
+
+    // Column term of A, shared by every row
+    std::vector<double> col_term(N);
+    for (j = 0; j < N; j++)
+        col_term[j] = (double)(j % 14);
+
+    // Values of the periodic routine1 patterns
+    float z_term[9], y_term[19];
+    for (i = 0; i < 9; i++)
+        z_term[i] = i - 0.08f;
+    for (i = 0; i < 19; i++)
+        y_term[i] = i + 0.07f;
+
+    // Skip the cache for matrices that will not stay in it anyway
+    const bool stream = (size_t)N * lda * sizeof(double) > llc_size();
+
+#pragma omp parallel
+    {
+        const int tid = omp_get_thread_num();
+        const int nthreads = omp_get_num_threads();
+        size_t begin, end;
+
+        // Initialize routine2 matrix
+        thread_range(N, 1, tid, nthreads, &begin, &end);
+        for (size_t r = begin; r < end; r++) {
+            double* row = A_data + r * lda;
+            initialize_matrix_row(row, col_term.data(), (double)(r % 99), N, stream);
+
+            // Reduced-precision copy streamed by routine2_par
+            if (a_precision == PREC_FP32) {
+                for (j = 0; j < N; j++)
+                    A_f32[r * lda + j] = (float)row[j];
+            }
+            else if (a_precision == PREC_BF16) {
+                for (j = 0; j < N; j++)
+                    A_bf16[r * lda + j] = float_to_bf16((float)row[j]);
+            }
+        }
+        if (stream)
+            _mm_sfence();
+
+        // Initialize routine1 arrays
+        thread_range(M, 16, tid, nthreads, &begin, &end);
+        unsigned int m9 = (unsigned int)(begin % 9), m19 = (unsigned int)(begin % 19);
+        for (size_t k = begin; k < end; k++) {
+            z[k] = z_term[m9];
+            y[k] = y_term[m19];
+            y_ref[k] = y[k];
+            m9 = m9 == 8 ? 0 : m9 + 1;
+            m19 = m19 == 18 ? 0 : m19 + 1;
+        }
+    }
+
+    // Initialize routine2 vectors
+    for (i = 0; i < N; i++) {
+        x[i] = (i % 19) - 0.01;
+        w[i] = (i % 5) - 0.002;
+        w_ref[i] = w[i];
+    }
+}
+
+void routine1(float alpha, float beta, unsigned int M) {
+
+    unsigned int i;
+
+    for (i = 0; i < M; i++)
+        y_ref[i] = y_ref[i] - alpha + beta - z[i];
+
+}
+
+void routine2(float alpha, float beta, unsigned int N) {
+
+    unsigned int i, j;
+
+    for (i = 0; i < N; i++)
+        for (j = 0; j < N; j++)
+            w_ref[i] += beta * x[j] + alpha * A[i][j] * x[j];
+
+}
+
+/*------------------------------ Vector kernels -------------------------------*/
+// Each routine has an SSE4.2, an AVX2+FMA and an AVX-512 variant. The best one
+// the CPU and OS support is picked once by select_kernels() and called through
+// the function pointers below, so one binary runs on any x86-64 host.
+
+// Horizontal sum of the two lanes of an __m128d
+static inline TARGET_SSE42 double hsum128_pd(__m128d v) {
+    return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+// Horizontal sum of the four lanes of an __m256d
+static inline TARGET_AVX2 double hsum256_pd(__m256d v) {
+    __m128d lo = _mm256_castpd256_pd128(v);
+    __m128d hi = _mm256_extractf128_pd(v, 1);
+    lo = _mm_add_pd(lo, hi);
+    return _mm_cvtsd_f64(_mm_add_sd(lo, _mm_unpackhi_pd(lo, lo)));
+}
+
+// Horizontal sum of the eight lanes of an __m512d. Used instead of
+// _mm512_reduce_add_pd: GCC expands that (and _mm512_castpd512_pd256) through
+// _mm512_extractf64x4_pd with an _mm256_undefined_pd() pass-through, which
+// trips -Wmaybe-uninitialized. The full-mask maskz form extracts the same
+// halves with a defined pass-through.
+static inline TARGET_AVX512 double hsum512_pd(__m512d v) {
+    __m256d lo = _mm512_maskz_extractf64x4_pd(0xF, v, 0);
+    __m256d hi = _mm512_maskz_extractf64x4_pd(0xF, v, 1);
+    return hsum256_pd(_mm256_add_pd(lo, hi));
+}
+
+// Lane mask with the first n (0..8) 32-bit lanes enabled, for AVX2 tails
+static inline TARGET_AVX2 __m256i tail_mask_epi32(int n) {
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+}
+
+// Lane mask with the first n (0..4) 64-bit lanes enabled, for AVX2 tails
+static inline TARGET_AVX2 __m256i tail_mask_epi64(int n) {
+    return _mm256_cmpgt_epi64(_mm256_set1_epi64x(n), _mm256_setr_epi64x(0, 1, 2, 3));
+}
+
+// routine1 kernels: y = y - alpha + beta - z over n elements, evaluated left to
+// right like routine1. With stream set, y and z are read with aligned loads and
+// y is written with non-temporal stores that bypass the cache; that only pays
+// off once the arrays no longer fit in the last level cache.
+
+static TARGET_SSE42 void routine1_sse42(float* yv, const float* zv, size_t n, float alpha, float beta, bool stream) {
+
+    size_t i = 0;
+    __m128 vec_alpha = _mm_set1_ps(alpha);
+    __m128 vec_beta = _mm_set1_ps(beta);
+
+    if (stream && (((uintptr_t)yv ^ (uintptr_t)zv) & 15) == 0) {
+        for (; i < n && ((uintptr_t)&yv[i] & 15) != 0; i++)
+            yv[i] = yv[i] - alpha + beta - zv[i];
+
+        for (; i + 4 <= n; i += 4) {
+            __m128 vec_y = _mm_load_ps(&yv[i]);
+            __m128 vec_z = _mm_load_ps(&zv[i]);
+            _mm_stream_ps(&yv[i], _mm_sub_ps(_mm_add_ps(_mm_sub_ps(vec_y, vec_alpha), vec_beta), vec_z));
+        }
+        _mm_sfence();
+    }
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 vec_y = _mm_loadu_ps(&yv[i]);
+        __m128 vec_z = _mm_loadu_ps(&zv[i]);
+        __m128 result = _mm_sub_ps(_mm_add_ps(_mm_sub_ps(vec_y, vec_alpha), vec_beta), vec_z);
+        _mm_storeu_ps(&yv[i], result);
+    }
+
+    for (; i < n; i++)
+        yv[i] = yv[i] - alpha + beta - zv[i];
+}
+
+static TARGET_AVX2 void routine1_avx2(float* yv, const float* zv, size_t n, float alpha, float beta, bool stream) {
+
+    size_t i = 0;
+    __m256 vec_alpha = _mm256_set1_ps(alpha);
+    __m256 vec_beta = _mm256_set1_ps(beta);
+
+    if (stream && (((uintptr_t)yv ^ (uintptr_t)zv) & 31) == 0) {
+        for (; i < n && ((uintptr_t)&yv[i] & 31) != 0; i++)
+            yv[i] = yv[i] - alpha + beta - zv[i];
+
+        for (; i + 16 <= n; i += 16) {
+            __m256 y0 = _mm256_load_ps(&yv[i]);
+            __m256 y1 = _mm256_load_ps(&yv[i + 8]);
+            __m256 z0 = _mm256_load_ps(&zv[i]);
+            __m256 z1 = _mm256_load_ps(&zv[i + 8]);
+            _mm256_stream_ps(&yv[i], _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y0, vec_alpha), vec_beta), z0));
+            _mm256_stream_ps(&yv[i + 8], _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y1, vec_alpha), vec_beta), z1));
+        }
+        _mm_sfence();
+    }
+
+    for (; i + 16 <= n; i += 16) {
+        __m256 y0 = _mm256_loadu_ps(&yv[i]);
+        __m256 y1 = _mm256_loadu_ps(&yv[i + 8]);
+        __m256 z0 = _mm256_loadu_ps(&zv[i]);
+        __m256 z1 = _mm256_loadu_ps(&zv[i + 8]);
+        y0 = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y0, vec_alpha), vec_beta), z0);
+        y1 = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y1, vec_alpha), vec_beta), z1);
+        _mm256_storeu_ps(&yv[i], y0);
+        _mm256_storeu_ps(&yv[i + 8], y1);
+    }
+
+    // Up to two masked steps for the remaining 0..15 elements
+    for (; i < n; i += 8) {
+        __m256i mask = tail_mask_epi32((int)(n - i));
+        __m256 y0 = _mm256_maskload_ps(&yv[i], mask);
+        __m256 z0 = _mm256_maskload_ps(&zv[i], mask);
+        y0 = _mm256_sub_ps(_mm256_add_ps(_mm256_sub_ps(y0, vec_alpha), vec_beta), z0);
+        _mm256_maskstore_ps(&yv[i], mask, y0);
+    }
+}
+
+static TARGET_AVX512 void routine1_avx512(float* yv, const float* zv, size_t n, float alpha, float beta, bool stream) {
+
+    size_t i = 0;
+    __m512 vec_alpha = _mm512_set1_ps(alpha);
+    __m512 vec_beta = _mm512_set1_ps(beta);
+
+    if (stream && (((uintptr_t)yv ^ (uintptr_t)zv) & 63) == 0) {
+        for (; i < n && ((uintptr_t)&yv[i] & 63) != 0; i++)
+            yv[i] = yv[i] - alpha + beta - zv[i];
+
+        for (; i + 16 <= n; i += 16) {
+            __m512 y0 = _mm512_load_ps(&yv[i]);
+            __m512 z0 = _mm512_load_ps(&zv[i]);
+            _mm512_stream_ps(&yv[i], _mm512_sub_ps(_mm512_add_ps(_mm512_sub_ps(y0, vec_alpha), vec_beta), z0));
+        }
+        _mm_sfence();
+    }
+
+    for (; i + 16 <= n; i += 16) {
+        __m512 y0 = _mm512_loadu_ps(&yv[i]);
+        __m512 z0 = _mm512_loadu_ps(&zv[i]);
+        y0 = _mm512_sub_ps(_mm512_add_ps(_mm512_sub_ps(y0, vec_alpha), vec_beta), z0);
+        _mm512_storeu_ps(&yv[i], y0);
+    }
+
+    if (i < n) {
+        __mmask16 mask = (__mmask16)((1u << (n - i)) - 1);
+        __m512 y0 = _mm512_maskz_loadu_ps(mask, &yv[i]);
+        __m512 z0 = _mm512_maskz_loadu_ps(mask, &zv[i]);
+        y0 = _mm512_sub_ps(_mm512_add_ps(_mm512_sub_ps(y0, vec_alpha), vec_beta), z0);
+        _mm512_mask_storeu_ps(&yv[i], mask, y0);
+    }
+}
+
+// routine2 block kernels: for rows r < rows of the matrix starting at a (row
+// stride lda) and columns c < cols,
+//     sums[r] += sum_c (beta * xb[c] + alpha * a[r][c] * xb[c])
+// Rows are register-blocked four at a time so each load of xb is shared, and
+// every row keeps its own accumulator until a single horizontal reduce at the end.
+
+static TARGET_SSE42 void routine2_block_sse42(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                              double alpha, double beta, double* sums) {
+
+    __m128d vec_alpha = _mm_set1_pd(alpha);
+    __m128d vec_beta = _mm_set1_pd(beta);
+    const int cvec = cols & ~1;
+
+    for (int r = 0; r < rows; r++) {
+        const double* ar = a + (size_t)r * lda;
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        int c = 0;
+
+        for (; c + 4 <= cols; c += 4) {
+            __m128d x0 = _mm_loadu_pd(&xb[c]);
+            __m128d x1 = _mm_loadu_pd(&xb[c + 2]);
+            acc0 = _mm_add_pd(acc0, _mm_add_pd(_mm_mul_pd(vec_beta, x0), _mm_mul_pd(_mm_loadu_pd(&ar[c]), _mm_mul_pd(vec_alpha, x0))));
+            acc1 = _mm_add_pd(acc1, _mm_add_pd(_mm_mul_pd(vec_beta, x1), _mm_mul_pd(_mm_loadu_pd(&ar[c + 2]), _mm_mul_pd(vec_alpha, x1))));
+        }
+        for (; c < cvec; c += 2) {
+            __m128d x0 = _mm_loadu_pd(&xb[c]);
+            acc0 = _mm_add_pd(acc0, _mm_add_pd(_mm_mul_pd(vec_beta, x0), _mm_mul_pd(_mm_loadu_pd(&ar[c]), _mm_mul_pd(vec_alpha, x0))));
+        }
+
+        double sum = hsum128_pd(_mm_add_pd(acc0, acc1));
+        for (; c < cols; c++)
+            sum += beta * xb[c] + alpha * ar[c] * xb[c];
+        sums[r] += sum;
+    }
+}
+
+static TARGET_AVX2 void routine2_block_avx2(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                            double alpha, double beta, double* sums) {
+
+    __m256d vec_alpha = _mm256_set1_pd(alpha);
+    __m256d vec_beta = _mm256_set1_pd(beta);
+    const int cvec = cols & ~3;
+    const __m256i mask = tail_mask_epi64(cols - cvec);
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        const double* a0 = a + (size_t)r * lda;
+        const double* a1 = a0 + lda;
+        const double* a2 = a1 + lda;
+        const double* a3 = a2 + lda;
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        __m256d acc2 = _mm256_setzero_pd();
+        __m256d acc3 = _mm256_setzero_pd();
+
+        for (int c = 0; c < cvec; c += 4) {
+            __m256d vec_x = _mm256_loadu_pd(&xb[c]);
+            __m256d bx = _mm256_mul_pd(vec_beta, vec_x);
+            __m256d ax = _mm256_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(_mm256_loadu_pd(&a0[c]), ax, bx));
+            acc1 = _mm256_add_pd(acc1, _mm256_fmadd_pd(_mm256_loadu_pd(&a1[c]), ax, bx));
+            acc2 = _mm256_add_pd(acc2, _mm256_fmadd_pd(_mm256_loadu_pd(&a2[c]), ax, bx));
+            acc3 = _mm256_add_pd(acc3, _mm256_fmadd_pd(_mm256_loadu_pd(&a3[c]), ax, bx));
+        }
+        if (cvec < cols) {
+            __m256d vec_x = _mm256_maskload_pd(&xb[cvec], mask);
+            __m256d bx = _mm256_mul_pd(vec_beta, vec_x);
+            __m256d ax = _mm256_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(_mm256_maskload_pd(&a0[cvec], mask), ax, bx));
+            acc1 = _mm256_add_pd(acc1, _mm256_fmadd_pd(_mm256_maskload_pd(&a1[cvec], mask), ax, bx));
+            acc2 = _mm256_add_pd(acc2, _mm256_fmadd_pd(_mm256_maskload_pd(&a2[cvec], mask), ax, bx));
+            acc3 = _mm256_add_pd(acc3, _mm256_fmadd_pd(_mm256_maskload_pd(&a3[cvec], mask), ax, bx));
+        }
+
+        sums[r] += hsum256_pd(acc0);
+        sums[r + 1] += hsum256_pd(acc1);
+        sums[r + 2] += hsum256_pd(acc2);
+        sums[r + 3] += hsum256_pd(acc3);
+    }
+
+    // Single rows: unroll over columns instead so there are still four independent chains
+    for (; r < rows; r++) {
+        const double* ar = a + (size_t)r * lda;
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        __m256d acc2 = _mm256_setzero_pd();
+        __m256d acc3 = _mm256_setzero_pd();
+        int c = 0;
+
+        for (; c + 16 <= cvec; c += 16) {
+            __m256d x0 = _mm256_loadu_pd(&xb[c]);
+            __m256d x1 = _mm256_loadu_pd(&xb[c + 4]);
+            __m256d x2 = _mm256_loadu_pd(&xb[c + 8]);
+            __m256d x3 = _mm256_loadu_pd(&xb[c + 12]);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(_mm256_loadu_pd(&ar[c]), _mm256_mul_pd(vec_alpha, x0), _mm256_mul_pd(vec_beta, x0)));
+            acc1 = _mm256_add_pd(acc1, _mm256_fmadd_pd(_mm256_loadu_pd(&ar[c + 4]), _mm256_mul_pd(vec_alpha, x1), _mm256_mul_pd(vec_beta, x1)));
+            acc2 = _mm256_add_pd(acc2, _mm256_fmadd_pd(_mm256_loadu_pd(&ar[c + 8]), _mm256_mul_pd(vec_alpha, x2), _mm256_mul_pd(vec_beta, x2)));
+            acc3 = _mm256_add_pd(acc3, _mm256_fmadd_pd(_mm256_loadu_pd(&ar[c + 12]), _mm256_mul_pd(vec_alpha, x3), _mm256_mul_pd(vec_beta, x3)));
+        }
+        for (; c < cvec; c += 4) {
+            __m256d x0 = _mm256_loadu_pd(&xb[c]);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(_mm256_loadu_pd(&ar[c]), _mm256_mul_pd(vec_alpha, x0), _mm256_mul_pd(vec_beta, x0)));
+        }
+        if (cvec < cols) {
+            __m256d x0 = _mm256_maskload_pd(&xb[cvec], mask);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(_mm256_maskload_pd(&ar[cvec], mask), _mm256_mul_pd(vec_alpha, x0), _mm256_mul_pd(vec_beta, x0)));
+        }
+
+        sums[r] += hsum256_pd(_mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3)));
+    }
+}
+
+static TARGET_AVX512 void routine2_block_avx512(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                                double alpha, double beta, double* sums) {
+
+    __m512d vec_alpha = _mm512_set1_pd(alpha);
+    __m512d vec_beta = _mm512_set1_pd(beta);
+    const int cvec = cols & ~7;
+    const __mmask8 mask = (__mmask8)((1u << (cols - cvec)) - 1);
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        const double* a0 = a + (size_t)r * lda;
+        const double* a1 = a0 + lda;
+        const double* a2 = a1 + lda;
+        const double* a3 = a2 + lda;
+        __m512d acc0 = _mm512_setzero_pd();
+        __m512d acc1 = _mm512_setzero_pd();
+        __m512d acc2 = _mm512_setzero_pd();
+        __m512d acc3 = _mm512_setzero_pd();
+
+        for (int c = 0; c < cvec; c += 8) {
+            __m512d vec_x = _mm512_loadu_pd(&xb[c]);
+            __m512d bx = _mm512_mul_pd(vec_beta, vec_x);
+            __m512d ax = _mm512_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(_mm512_loadu_pd(&a0[c]), ax, bx));
+            acc1 = _mm512_add_pd(acc1, _mm512_fmadd_pd(_mm512_loadu_pd(&a1[c]), ax, bx));
+            acc2 = _mm512_add_pd(acc2, _mm512_fmadd_pd(_mm512_loadu_pd(&a2[c]), ax, bx));
+            acc3 = _mm512_add_pd(acc3, _mm512_fmadd_pd(_mm512_loadu_pd(&a3[c]), ax, bx));
+        }
+        if (cvec < cols) {
+            __m512d vec_x = _mm512_maskz_loadu_pd(mask, &xb[cvec]);
+            __m512d bx = _mm512_mul_pd(vec_beta, vec_x);
+            __m512d ax = _mm512_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, &a0[cvec]), ax, bx));
+            acc1 = _mm512_add_pd(acc1, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, &a1[cvec]), ax, bx));
+            acc2 = _mm512_add_pd(acc2, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, &a2[cvec]), ax, bx));
+            acc3 = _mm512_add_pd(acc3, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, &a3[cvec]), ax, bx));
+        }
+
+        sums[r] += hsum512_pd(acc0);
+        sums[r + 1] += hsum512_pd(acc1);
+        sums[r + 2] += hsum512_pd(acc2);
+        sums[r + 3] += hsum512_pd(acc3);
+    }
+
+    for (; r < rows; r++) {
+        const double* ar = a + (size_t)r * lda;
+        __m512d acc0 = _mm512_setzero_pd();
+        __m512d acc1 = _mm512_setzero_pd();
+        int c = 0;
+
+        for (; c + 16 <= cvec; c += 16) {
+            __m512d x0 = _mm512_loadu_pd(&xb[c]);
+            __m512d x1 = _mm512_loadu_pd(&xb[c + 8]);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(_mm512_loadu_pd(&ar[c]), _mm512_mul_pd(vec_alpha, x0), _mm512_mul_pd(vec_beta, x0)));
+            acc1 = _mm512_add_pd(acc1, _mm512_fmadd_pd(_mm512_loadu_pd(&ar[c + 8]), _mm512_mul_pd(vec_alpha, x1), _mm512_mul_pd(vec_beta, x1)));
+        }
+        for (; c < cvec; c += 8) {
+            __m512d x0 = _mm512_loadu_pd(&xb[c]);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(_mm512_loadu_pd(&ar[c]), _mm512_mul_pd(vec_alpha, x0), _mm512_mul_pd(vec_beta, x0)));
+        }
+        if (cvec < cols) {
+            __m512d x0 = _mm512_maskz_loadu_pd(mask, &xb[cvec]);
+            acc1 = _mm512_add_pd(acc1, _mm512_fmadd_pd(_mm512_maskz_loadu_pd(mask, &ar[cvec]), _mm512_mul_pd(vec_alpha, x0), _mm512_mul_pd(vec_beta, x0)));
+        }
+
+        sums[r] += hsum512_pd(_mm512_add_pd(acc0, acc1));
+    }
+}
+
+// Deterministic routine2 row kernels: the sum over one row of
+// beta * x[c] + alpha * a[c] * x[c], with a result that does not depend on the
+// instruction set, the thread count or any tuning parameter. Column c always
+// goes to lane c % DET_LANES and is added with Kahan compensation. The lanes
+// are combined in a fixed pairwise tree. Every term is computed with the
+// multiplies and the add of the scalar formula; NO_CONTRACT stops the
+// compiler from fusing them into FMAs, which round differently.
+
+#define DET_LANES 16
+
+// Tail columns and the final combine, shared by all instruction sets. The
+// tail terms must round exactly like the vector terms, so this must not
+// contract either, whatever the build targets (-march=native enables FMA):
+// NO_CONTRACT covers GCC, and on Clang the pragma turns contraction off and
+// each product is a separate statement, which fp-contract=on never fuses.
+static NOINLINE NO_CONTRACT double routine2_row_det_finish(double* s, double* c, const double* a, const double* xv,
+                                                           int j, int n, double alpha, double beta) {
+#if defined(__clang__)
+#pragma clang fp contract(off)
+#endif
+
+    for (; j < n; j++) {
+        const int l = j % DET_LANES;
+        const double bx = beta * xv[j];
+        const double abx = alpha * a[j] * xv[j];
+        double t = bx + abx;
+        double y_k = t - c[l];
+        double sum = s[l] + y_k;
+        c[l] = (sum - s[l]) - y_k;
+        s[l] = sum;
+    }
+
+    for (int l = 0; l < DET_LANES; l++)
+        s[l] -= c[l];
+    for (int half = DET_LANES / 2; half > 0; half /= 2)
+        for (int l = 0; l < half; l++)
+            s[l] += s[l + half];
+    return s[0];
+}
+
+static TARGET_SSE42 NO_CONTRACT double routine2_row_det_sse42(const double* a, const double* xv, int n,
+                                                              double alpha, double beta) {
+
+    const __m128d vec_alpha = _mm_set1_pd(alpha);
+    const __m128d vec_beta = _mm_set1_pd(beta);
+    const int nvec = n - n % DET_LANES;
+    __m128d s[DET_LANES / 2], c[DET_LANES / 2];
+    double ls[DET_LANES], lc[DET_LANES];
+
+    for (int k = 0; k < DET_LANES / 2; k++)
+        s[k] = c[k] = _mm_setzero_pd();
+
+    for (int j = 0; j < nvec; j += DET_LANES) {
+        for (int k = 0; k < DET_LANES / 2; k++) {
+            __m128d vec_x = _mm_loadu_pd(&xv[j + 2 * k]);
+            __m128d t = _mm_add_pd(_mm_mul_pd(vec_beta, vec_x),
+                                   _mm_mul_pd(_mm_mul_pd(vec_alpha, _mm_loadu_pd(&a[j + 2 * k])), vec_x));
+            __m128d y_k = _mm_sub_pd(t, c[k]);
+            __m128d sum = _mm_add_pd(s[k], y_k);
+            c[k] = _mm_sub_pd(_mm_sub_pd(sum, s[k]), y_k);
+            s[k] = sum;
+        }
+    }
+
+    for (int k = 0; k < DET_LANES / 2; k++) {
+        _mm_storeu_pd(&ls[2 * k], s[k]);
+        _mm_storeu_pd(&lc[2 * k], c[k]);
+    }
+    return routine2_row_det_finish(ls, lc, a, xv, nvec, n, alpha, beta);
+}
+
+static TARGET_AVX2 NO_CONTRACT double routine2_row_det_avx2(const double* a, const double* xv, int n,
+                                                            double alpha, double beta) {
+
+    const __m256d vec_alpha = _mm256_set1_pd(alpha);
+    const __m256d vec_beta = _mm256_set1_pd(beta);
+    const int nvec = n - n % DET_LANES;
+    __m256d s[DET_LANES / 4], c[DET_LANES / 4];
+    double ls[DET_LANES], lc[DET_LANES];
+
+    for (int k = 0; k < DET_LANES / 4; k++)
+        s[k] = c[k] = _mm256_setzero_pd();
+
+    for (int j = 0; j < nvec; j += DET_LANES) {
+        for (int k = 0; k < DET_LANES / 4; k++) {
+            __m256d vec_x = _mm256_loadu_pd(&xv[j + 4 * k]);
+            __m256d t = _mm256_add_pd(_mm256_mul_pd(vec_beta, vec_x),
+                                      _mm256_mul_pd(_mm256_mul_pd(vec_alpha, _mm256_loadu_pd(&a[j + 4 * k])), vec_x));
+            __m256d y_k = _mm256_sub_pd(t, c[k]);
+            __m256d sum = _mm256_add_pd(s[k], y_k);
+            c[k] = _mm256_sub_pd(_mm256_sub_pd(sum, s[k]), y_k);
+            s[k] = sum;
+        }
+    }
+
+    for (int k = 0; k < DET_LANES / 4; k++) {
+        _mm256_storeu_pd(&ls[4 * k], s[k]);
+        _mm256_storeu_pd(&lc[4 * k], c[k]);
+    }
+    return routine2_row_det_finish(ls, lc, a, xv, nvec, n, alpha, beta);
+}
+
+static TARGET_AVX512 NO_CONTRACT double routine2_row_det_avx512(const double* a, const double* xv, int n,
+                                                                double alpha, double beta) {
+
+    const __m512d vec_alpha = _mm512_set1_pd(alpha);
+    const __m512d vec_beta = _mm512_set1_pd(beta);
+    const int nvec = n - n % DET_LANES;
+    __m512d s[DET_LANES / 8], c[DET_LANES / 8];
+    double ls[DET_LANES], lc[DET_LANES];
+
+    for (int k = 0; k < DET_LANES / 8; k++)
+        s[k] = c[k] = _mm512_setzero_pd();
+
+    for (int j = 0; j < nvec; j += DET_LANES) {
+        for (int k = 0; k < DET_LANES / 8; k++) {
+            __m512d vec_x = _mm512_loadu_pd(&xv[j + 8 * k]);
+            __m512d t = _mm512_add_pd(_mm512_mul_pd(vec_beta, vec_x),
+                                      _mm512_mul_pd(_mm512_mul_pd(vec_alpha, _mm512_loadu_pd(&a[j + 8 * k])), vec_x));
+            __m512d y_k = _mm512_sub_pd(t, c[k]);
+            __m512d sum = _mm512_add_pd(s[k], y_k);
+            c[k] = _mm512_sub_pd(_mm512_sub_pd(sum, s[k]), y_k);
+            s[k] = sum;
+        }
+    }
+
+    for (int k = 0; k < DET_LANES / 8; k++) {
+        _mm512_storeu_pd(&ls[8 * k], s[k]);
+        _mm512_storeu_pd(&lc[8 * k], c[k]);
+    }
+    return routine2_row_det_finish(ls, lc, a, xv, nvec, n, alpha, beta);
+}
+
+// Reduced-precision storage for A. The matrix is kept as float or bfloat16
+// (the upper half of a float) and widened to double as it is loaded, so the
+// arithmetic and accumulation stay in double while half or a quarter of the
+// bytes are streamed.
+
+static inline double widen(float v) {
+    return v;
+}
+
+static inline double widen(uint16_t v) {
+    uint32_t bits = (uint32_t)v << 16;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+// Round a float to the nearest bfloat16, ties to even
+static inline uint16_t float_to_bf16(float f) {
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    bits += 0x7fff + ((bits >> 16) & 1);
+    return (uint16_t)(bits >> 16);
+}
+
+static inline TARGET_AVX2 __m256d load4_widen(const float* p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+static inline TARGET_AVX2 __m256d load4_widen(const uint16_t* p) {
+    __m128i h = _mm_loadl_epi64((const __m128i*)p);
+    return _mm256_cvtps_pd(_mm_castsi128_ps(_mm_slli_epi32(_mm_cvtepu16_epi32(h), 16)));
+}
+
+// maskz with a full mask: plain _mm512_cvtps_pd has an undefined pass-through
+// that trips -Wmaybe-uninitialized in GCC.
+static inline TARGET_AVX512 __m512d load8_widen(const float* p) {
+    return _mm512_maskz_cvtps_pd(0xFF, _mm256_loadu_ps(p));
+}
+
+static inline TARGET_AVX512 __m512d load8_widen(const uint16_t* p) {
+    __m128i h = _mm_loadu_si128((const __m128i*)p);
+    return _mm512_maskz_cvtps_pd(0xFF, _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_cvtepu16_epi32(h), 16)));
+}
+
+// Same contract as the routine2 block kernels, for a matrix of T elements.
+// Scalar version for hosts without AVX2.
+template <typename T>
+static void routine2_block_lowp_scalar(const T* a, size_t lda, int rows, const double* xb, int cols,
+                                       double alpha, double beta, double* sums) {
+
+    for (int r = 0; r < rows; r++) {
+        const T* ar = a + (size_t)r * lda;
+        double sum = 0.0;
+        for (int c = 0; c < cols; c++)
+            sum += beta * xb[c] + alpha * widen(ar[c]) * xb[c];
+        sums[r] += sum;
+    }
+}
+
+template <typename T>
+static TARGET_AVX2 void routine2_block_lowp_avx2(const T* a, size_t lda, int rows, const double* xb, int cols,
+                                                 double alpha, double beta, double* sums) {
+
+    __m256d vec_alpha = _mm256_set1_pd(alpha);
+    __m256d vec_beta = _mm256_set1_pd(beta);
+    const int cvec = cols & ~3;
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        const T* a0 = a + (size_t)r * lda;
+        const T* a1 = a0 + lda;
+        const T* a2 = a1 + lda;
+        const T* a3 = a2 + lda;
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        __m256d acc2 = _mm256_setzero_pd();
+        __m256d acc3 = _mm256_setzero_pd();
+
+        for (int c = 0; c < cvec; c += 4) {
+            __m256d vec_x = _mm256_loadu_pd(&xb[c]);
+            __m256d bx = _mm256_mul_pd(vec_beta, vec_x);
+            __m256d ax = _mm256_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(load4_widen(&a0[c]), ax, bx));
+            acc1 = _mm256_add_pd(acc1, _mm256_fmadd_pd(load4_widen(&a1[c]), ax, bx));
+            acc2 = _mm256_add_pd(acc2, _mm256_fmadd_pd(load4_widen(&a2[c]), ax, bx));
+            acc3 = _mm256_add_pd(acc3, _mm256_fmadd_pd(load4_widen(&a3[c]), ax, bx));
+        }
+
+        sums[r] += hsum256_pd(acc0);
+        sums[r + 1] += hsum256_pd(acc1);
+        sums[r + 2] += hsum256_pd(acc2);
+        sums[r + 3] += hsum256_pd(acc3);
+    }
+
+    for (; r < rows; r++) {
+        const T* ar = a + (size_t)r * lda;
+        __m256d acc0 = _mm256_setzero_pd();
+        __m256d acc1 = _mm256_setzero_pd();
+        int c = 0;
+
+        for (; c + 8 <= cvec; c += 8) {
+            __m256d x0 = _mm256_loadu_pd(&xb[c]);
+            __m256d x1 = _mm256_loadu_pd(&xb[c + 4]);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(load4_widen(&ar[c]), _mm256_mul_pd(vec_alpha, x0), _mm256_mul_pd(vec_beta, x0)));
+            acc1 = _mm256_add_pd(acc1, _mm256_fmadd_pd(load4_widen(&ar[c + 4]), _mm256_mul_pd(vec_alpha, x1), _mm256_mul_pd(vec_beta, x1)));
+        }
+        for (; c < cvec; c += 4) {
+            __m256d x0 = _mm256_loadu_pd(&xb[c]);
+            acc0 = _mm256_add_pd(acc0, _mm256_fmadd_pd(load4_widen(&ar[c]), _mm256_mul_pd(vec_alpha, x0), _mm256_mul_pd(vec_beta, x0)));
+        }
+
+        sums[r] += hsum256_pd(_mm256_add_pd(acc0, acc1));
+    }
+
+    // Remaining 0..3 columns
+    if (cvec < cols)
+        routine2_block_lowp_scalar(a + cvec, lda, rows, xb + cvec, cols - cvec, alpha, beta, sums);
+}
+
+template <typename T>
+static TARGET_AVX512 void routine2_block_lowp_avx512(const T* a, size_t lda, int rows, const double* xb, int cols,
+                                                     double alpha, double beta, double* sums) {
+
+    __m512d vec_alpha = _mm512_set1_pd(alpha);
+    __m512d vec_beta = _mm512_set1_pd(beta);
+    const int cvec = cols & ~7;
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        const T* a0 = a + (size_t)r * lda;
+        const T* a1 = a0 + lda;
+        const T* a2 = a1 + lda;
+        const T* a3 = a2 + lda;
+        __m512d acc0 = _mm512_setzero_pd();
+        __m512d acc1 = _mm512_setzero_pd();
+        __m512d acc2 = _mm512_setzero_pd();
+        __m512d acc3 = _mm512_setzero_pd();
+
+        for (int c = 0; c < cvec; c += 8) {
+            __m512d vec_x = _mm512_loadu_pd(&xb[c]);
+            __m512d bx = _mm512_mul_pd(vec_beta, vec_x);
+            __m512d ax = _mm512_mul_pd(vec_alpha, vec_x);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(load8_widen(&a0[c]), ax, bx));
+            acc1 = _mm512_add_pd(acc1, _mm512_fmadd_pd(load8_widen(&a1[c]), ax, bx));
+            acc2 = _mm512_add_pd(acc2, _mm512_fmadd_pd(load8_widen(&a2[c]), ax, bx));
+            acc3 = _mm512_add_pd(acc3, _mm512_fmadd_pd(load8_widen(&a3[c]), ax, bx));
+        }
+
+        sums[r] += hsum512_pd(acc0);
+        sums[r + 1] += hsum512_pd(acc1);
+        sums[r + 2] += hsum512_pd(acc2);
+        sums[r + 3] += hsum512_pd(acc3);
+    }
+
+    for (; r < rows; r++) {
+        const T* ar = a + (size_t)r * lda;
+        __m512d acc0 = _mm512_setzero_pd();
+
+        for (int c = 0; c < cvec; c += 8) {
+            __m512d x0 = _mm512_loadu_pd(&xb[c]);
+            acc0 = _mm512_add_pd(acc0, _mm512_fmadd_pd(load8_widen(&ar[c]), _mm512_mul_pd(vec_alpha, x0), _mm512_mul_pd(vec_beta, x0)));
+        }
+
+        sums[r] += hsum512_pd(acc0);
+    }
+
+    // Remaining 0..7 columns
+    if (cvec < cols)
+        routine2_block_lowp_scalar(a + cvec, lda, rows, xb + cvec, cols - cvec, alpha, beta, sums);
+}
+
+// routine2 batch micro-kernels: dots[r * K + k] += sum_c a[r][c] * xs[k][c] for
+// RB rows and KB vectors at once, so each vector of A is loaded once for KB
+// right-hand sides and each vector of x once for RB rows. The beta term does
+// not depend on the row and is added separately by routine2_batch.
+
+template <int RB, int KB>
+static TARGET_AVX2 void routine2_batch_micro_avx2(const double* a, size_t lda, const double* const* xs, int col,
+                                                  int cols, int K, double* dots) {
+
+    __m256d acc[RB][KB];
+    const int cvec = cols & ~3;
+
+    for (int r = 0; r < RB; r++)
+        for (int k = 0; k < KB; k++)
+            acc[r][k] = _mm256_setzero_pd();
+
+    for (int c = 0; c < cvec; c += 4) {
+        __m256d va[RB];
+        for (int r = 0; r < RB; r++)
+            va[r] = _mm256_loadu_pd(&a[(size_t)r * lda + c]);
+        for (int k = 0; k < KB; k++) {
+            __m256d vx = _mm256_loadu_pd(&xs[k][col + c]);
+            for (int r = 0; r < RB; r++)
+                acc[r][k] = _mm256_fmadd_pd(va[r], vx, acc[r][k]);
+        }
+    }
+
+    for (int r = 0; r < RB; r++)
+        for (int k = 0; k < KB; k++) {
+            double sum = hsum256_pd(acc[r][k]);
+            for (int c = cvec; c < cols; c++)
+                sum += a[(size_t)r * lda + c] * xs[k][col + c];
+            dots[r * K + k] += sum;
+        }
+}
+
+template <int RB, int KB>
+static TARGET_AVX512 void routine2_batch_micro_avx512(const double* a, size_t lda, const double* const* xs, int col,
+                                                      int cols, int K, double* dots) {
+
+    __m512d acc[RB][KB];
+    const int cvec = cols & ~7;
+
+    for (int r = 0; r < RB; r++)
+        for (int k = 0; k < KB; k++)
+            acc[r][k] = _mm512_setzero_pd();
+
+    for (int c = 0; c < cvec; c += 8) {
+        __m512d va[RB];
+        for (int r = 0; r < RB; r++)
+            va[r] = _mm512_loadu_pd(&a[(size_t)r * lda + c]);
+        for (int k = 0; k < KB; k++) {
+            __m512d vx = _mm512_loadu_pd(&xs[k][col + c]);
+            for (int r = 0; r < RB; r++)
+                acc[r][k] = _mm512_fmadd_pd(va[r], vx, acc[r][k]);
+        }
+    }
+
+    for (int r = 0; r < RB; r++)
+        for (int k = 0; k < KB; k++) {
+            double sum = hsum512_pd(acc[r][k]);
+            for (int c = cvec; c < cols; c++)
+                sum += a[(size_t)r * lda + c] * xs[k][col + c];
+            dots[r * K + k] += sum;
+        }
+}
+
+// Batch block kernels: tile rows x vectors with the largest micro-kernel that
+// fits (2x4 on AVX2's 16 registers, 4x4 on AVX-512's 32) and fall back to
+// narrower ones at the edges.
+
+static void routine2_batch_block_scalar(const double* a, size_t lda, int rows, const double* const* xs, int col,
+                                        int cols, int K, double* dots) {
+
+    for (int r = 0; r < rows; r++)
+        for (int k = 0; k < K; k++) {
+            double sum = 0.0;
+            for (int c = 0; c < cols; c++)
+                sum += a[(size_t)r * lda + c] * xs[k][col + c];
+            dots[r * K + k] += sum;
+        }
+}
+
+static TARGET_AVX2 void routine2_batch_block_avx2(const double* a, size_t lda, int rows, const double* const* xs,
+                                                  int col, int cols, int K, double* dots) {
+
+    int r = 0;
+
+    for (; r + 2 <= rows; r += 2) {
+        int k = 0;
+        for (; k + 4 <= K; k += 4)
+            routine2_batch_micro_avx2<2, 4>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+        for (; k < K; k++)
+            routine2_batch_micro_avx2<2, 1>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+    }
+
+    for (; r < rows; r++) {
+        int k = 0;
+        for (; k + 4 <= K; k += 4)
+            routine2_batch_micro_avx2<1, 4>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+        for (; k < K; k++)
+            routine2_batch_micro_avx2<1, 1>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+    }
+}
+
+static TARGET_AVX512 void routine2_batch_block_avx512(const double* a, size_t lda, int rows, const double* const* xs,
+                                                      int col, int cols, int K, double* dots) {
+
+    int r = 0;
+
+    for (; r + 4 <= rows; r += 4) {
+        int k = 0;
+        for (; k + 4 <= K; k += 4)
+            routine2_batch_micro_avx512<4, 4>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+        for (; k < K; k++)
+            routine2_batch_micro_avx512<4, 1>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+    }
+
+    for (; r < rows; r++) {
+        int k = 0;
+        for (; k + 4 <= K; k += 4)
+            routine2_batch_micro_avx512<1, 4>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+        for (; k < K; k++)
+            routine2_batch_micro_avx512<1, 1>(a + (size_t)r * lda, lda, xs + k, col, cols, K, dots + r * K + k);
+    }
+}
+
+/*-------------------------- Fused kernel templates ---------------------------*/
+// A small layer for writing routine1/routine2-style kernels once. A kernel is
+// described by a struct of templated expressions; the loop templates below
+// turn it into a vectorized loop with a scalar tail for each instruction set.
+// Coefficients are either runtime values or the compile-time constants
+// coef_zero / coef_one, in which case the terms they cancel are removed from
+// the generated code entirely.
+
+// Instruction set traits: register types, widths and the basic operations
+struct isa_sse42 {
+    typedef __m128 ps;
+    typedef __m128d pd;
+    enum { ps_width = 4, pd_width = 2 };
+    static inline TARGET_SSE42 ps load(const float* p) { return _mm_loadu_ps(p); }
+    static inline TARGET_SSE42 pd load(const double* p) { return _mm_loadu_pd(p); }
+    static inline TARGET_SSE42 void store(float* p, ps v) { _mm_storeu_ps(p, v); }
+    static inline TARGET_SSE42 ps set1(float v) { return _mm_set1_ps(v); }
+    static inline TARGET_SSE42 pd set1(double v) { return _mm_set1_pd(v); }
+    static inline TARGET_SSE42 pd zero_pd() { return _mm_setzero_pd(); }
+    static inline TARGET_SSE42 ps add(ps a, ps b) { return _mm_add_ps(a, b); }
+    static inline TARGET_SSE42 pd add(pd a, pd b) { return _mm_add_pd(a, b); }
+    static inline TARGET_SSE42 ps sub(ps a, ps b) { return _mm_sub_ps(a, b); }
+    static inline TARGET_SSE42 pd sub(pd a, pd b) { return _mm_sub_pd(a, b); }
+    static inline TARGET_SSE42 ps mul(ps a, ps b) { return _mm_mul_ps(a, b); }
+    static inline TARGET_SSE42 pd mul(pd a, pd b) { return _mm_mul_pd(a, b); }
+    static inline TARGET_SSE42 double reduce(pd v) { return hsum128_pd(v); }
+};
+
+struct isa_avx2 {
+    typedef __m256 ps;
+    typedef __m256d pd;
+    enum { ps_width = 8, pd_width = 4 };
+    static inline TARGET_AVX2 ps load(const float* p) { return _mm256_loadu_ps(p); }
+    static inline TARGET_AVX2 pd load(const double* p) { return _mm256_loadu_pd(p); }
+    static inline TARGET_AVX2 void store(float* p, ps v) { _mm256_storeu_ps(p, v); }
+    static inline TARGET_AVX2 ps set1(float v) { return _mm256_set1_ps(v); }
+    static inline TARGET_AVX2 pd set1(double v) { return _mm256_set1_pd(v); }
+    static inline TARGET_AVX2 pd zero_pd() { return _mm256_setzero_pd(); }
+    static inline TARGET_AVX2 ps add(ps a, ps b) { return _mm256_add_ps(a, b); }
+    static inline TARGET_AVX2 pd add(pd a, pd b) { return _mm256_add_pd(a, b); }
+    static inline TARGET_AVX2 ps sub(ps a, ps b) { return _mm256_sub_ps(a, b); }
+    static inline TARGET_AVX2 pd sub(pd a, pd b) { return _mm256_sub_pd(a, b); }
+    static inline TARGET_AVX2 ps mul(ps a, ps b) { return _mm256_mul_ps(a, b); }
+    static inline TARGET_AVX2 pd mul(pd a, pd b) { return _mm256_mul_pd(a, b); }
+    static inline TARGET_AVX2 double reduce(pd v) { return hsum256_pd(v); }
+};
+
+struct isa_avx512 {
+    typedef __m512 ps;
+    typedef __m512d pd;
+    enum { ps_width = 16, pd_width = 8 };
+    static inline TARGET_AVX512 ps load(const float* p) { return _mm512_loadu_ps(p); }
+    static inline TARGET_AVX512 pd load(const double* p) { return _mm512_loadu_pd(p); }
+    static inline TARGET_AVX512 void store(float* p, ps v) { _mm512_storeu_ps(p, v); }
+    static inline TARGET_AVX512 ps set1(float v) { return _mm512_set1_ps(v); }
+    static inline TARGET_AVX512 pd set1(double v) { return _mm512_set1_pd(v); }
+    static inline TARGET_AVX512 pd zero_pd() { return _mm512_setzero_pd(); }
+    static inline TARGET_AVX512 ps add(ps a, ps b) { return _mm512_add_ps(a, b); }
+    static inline TARGET_AVX512 pd add(pd a, pd b) { return _mm512_add_pd(a, b); }
+    static inline TARGET_AVX512 ps sub(ps a, ps b) { return _mm512_sub_ps(a, b); }
+    static inline TARGET_AVX512 pd sub(pd a, pd b) { return _mm512_sub_pd(a, b); }
+    static inline TARGET_AVX512 ps mul(ps a, ps b) { return _mm512_mul_ps(a, b); }
+    static inline TARGET_AVX512 pd mul(pd a, pd b) { return _mm512_mul_pd(a, b); }
+    static inline TARGET_AVX512 double reduce(pd v) { return hsum512_pd(v); }
+};
+
+// GCC warns that simd values are returned without AVX enabled. They are only
+// ever flattened into the TARGET_* wrappers, so the ABI of the out-of-line
+// versions does not matter; the pragma covers just this type.
+#if defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+// Vector of T for instruction set Isa, with arithmetic operators so kernel
+// descriptions read like the scalar formula
+template <class Isa, typename T> struct simd;
+
+template <class Isa> struct simd<Isa, float> {
+    typedef float element;
+    enum { width = Isa::ps_width };
+    typename Isa::ps v;
+    static simd load(const float* p) { simd r = { Isa::load(p) }; return r; }
+    static simd set1(float s) { simd r = { Isa::set1(s) }; return r; }
+    void store(float* p) const { Isa::store(p, v); }
+};
+
+template <class Isa> struct simd<Isa, double> {
+    typedef double element;
+    enum { width = Isa::pd_width };
+    typename Isa::pd v;
+    static simd load(const double* p) { simd r = { Isa::load(p) }; return r; }
+    static simd set1(double s) { simd r = { Isa::set1(s) }; return r; }
+    static simd zero() { simd r = { Isa::zero_pd() }; return r; }
+    double reduce() const { return Isa::reduce(v); }
+};
+
+template <class Isa, typename T> inline simd<Isa, T> operator+(const simd<Isa, T>& a, const simd<Isa, T>& b) { simd<Isa, T> r = { Isa::add(a.v, b.v) }; return r; }
+template <class Isa, typename T> inline simd<Isa, T> operator-(const simd<Isa, T>& a, const simd<Isa, T>& b) { simd<Isa, T> r = { Isa::sub(a.v, b.v) }; return r; }
+template <class Isa, typename T> inline simd<Isa, T> operator*(const simd<Isa, T>& a, const simd<Isa, T>& b) { simd<Isa, T> r = { Isa::mul(a.v, b.v) }; return r; }
+
+#if defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+// Compile-time coefficients. Adding or subtracting coef_zero and multiplying
+// by coef_one return the other operand unchanged; multiplying by coef_zero
+// yields coef_zero, so the whole term disappears.
+struct coef_zero {};
+struct coef_one {};
+
+template <class V> inline V operator+(const V& a, coef_zero) { return a; }
+template <class V> inline V operator+(coef_zero, const V& a) { return a; }
+template <class V> inline V operator-(const V& a, coef_zero) { return a; }
+template <class V> inline coef_zero operator*(const V&, coef_zero) { return coef_zero(); }
+template <class V> inline coef_zero operator*(coef_zero, const V&) { return coef_zero(); }
+template <class V> inline V operator*(const V& a, coef_one) { return a; }
+template <class V> inline V operator*(coef_one, const V& a) { return a; }
+inline coef_zero operator+(coef_zero, coef_zero) { return coef_zero(); }
+inline coef_zero operator*(coef_zero, coef_zero) { return coef_zero(); }
+inline coef_zero operator*(coef_zero, coef_one) { return coef_zero(); }
+inline coef_zero operator*(coef_one, coef_zero) { return coef_zero(); }
+inline coef_one operator*(coef_one, coef_one) { return coef_one(); }
+
+// Converts a coefficient to the operand type used inside a loop over V:
+// runtime values are broadcast, compile-time constants pass through
+template <class V, class C> struct coef_arg {
+    typedef V type;
+    static V get(C c) { return V::set1((typename V::element)c); }
+};
+template <> struct coef_arg<float, float> {
+    typedef float type;
+    static float get(float c) { return c; }
+};
+template <> struct coef_arg<double, double> {
+    typedef double type;
+    static double get(double c) { return c; }
+};
+template <class V> struct coef_arg<V, coef_zero> {
+    typedef coef_zero type;
+    static coef_zero get(coef_zero c) { return c; }
+};
+template <class V> struct coef_arg<V, coef_one> {
+    typedef coef_one type;
+    static coef_one get(coef_one c) { return c; }
+};
+
+// Elementwise update y[i] = Update::apply(y[i], z[i], alpha, beta)
+template <class Isa, class Update, class A, class B>
+static inline void fused_elementwise(float* yv, const float* zv, size_t n, A alpha, B beta) {
+
+    typedef simd<Isa, float> V;
+    const size_t W = V::width;
+    typename coef_arg<V, A>::type va = coef_arg<V, A>::get(alpha);
+    typename coef_arg<V, B>::type vb = coef_arg<V, B>::get(beta);
+    typename coef_arg<float, A>::type sa = coef_arg<float, A>::get(alpha);
+    typename coef_arg<float, B>::type sb = coef_arg<float, B>::get(beta);
+    size_t i = 0;
+
+    for (; i + 2 * W <= n; i += 2 * W) {
+        V r0 = Update::apply(V::load(&yv[i]), V::load(&zv[i]), va, vb);
+        V r1 = Update::apply(V::load(&yv[i + W]), V::load(&zv[i + W]), va, vb);
+        r0.store(&yv[i]);
+        r1.store(&yv[i + W]);
+    }
+    for (; i + W <= n; i += W)
+        Update::apply(V::load(&yv[i]), V::load(&zv[i]), va, vb).store(&yv[i]);
+    for (; i < n; i++)
+        yv[i] = Update::apply(yv[i], zv[i], sa, sb);
+}
+
+// The same update applied `steps` times in a row to every element while it is
+// held in a register, so y and z are read and y is written once for all of the
+// steps. Each element goes through exactly the operations of `steps` separate
+// passes, so the result is the same bit for bit.
+template <class Isa, class Update, class A, class B>
+static inline void fused_elementwise_steps(float* yv, const float* zv, size_t n, A alpha, B beta, int steps) {
+
+    typedef simd<Isa, float> V;
+    const size_t W = V::width;
+    typename coef_arg<V, A>::type va = coef_arg<V, A>::get(alpha);
+    typename coef_arg<V, B>::type vb = coef_arg<V, B>::get(beta);
+    typename coef_arg<float, A>::type sa = coef_arg<float, A>::get(alpha);
+    typename coef_arg<float, B>::type sb = coef_arg<float, B>::get(beta);
+    size_t i = 0;
+
+    for (; i + 2 * W <= n; i += 2 * W) {
+        V y0 = V::load(&yv[i]), y1 = V::load(&yv[i + W]);
+        const V z0 = V::load(&zv[i]), z1 = V::load(&zv[i + W]);
+        for (int t = 0; t < steps; t++) {
+            y0 = Update::apply(y0, z0, va, vb);
+            y1 = Update::apply(y1, z1, va, vb);
+        }
+        y0.store(&yv[i]);
+        y1.store(&yv[i + W]);
+    }
+    for (; i < n; i++) {
+        float yi = yv[i];
+        for (int t = 0; t < steps; t++)
+            yi = Update::apply(yi, zv[i], sa, sb);
+        yv[i] = yi;
+    }
+}
+
+// Row reduction sums[r] += sum_c (Terms::invariant(x[c]) + Terms::row(a[r][c], x[c])).
+// The invariant part does not depend on the row, so it is summed once for the
+// whole block and added to every row. Each row is accumulated in ACC
+// independent vector chains (a power of two), combined pairwise at the end.
+template <class Isa, class Terms, int ACC, class A, class B>
+static inline void fused_rowreduce(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                   A alpha, B beta, double* sums) {
+
+    typedef simd<Isa, double> V;
+    const int W = V::width;
+    const int cvec = cols - cols % W;
+    typename coef_arg<V, A>::type va = coef_arg<V, A>::get(alpha);
+    typename coef_arg<V, B>::type vb = coef_arg<V, B>::get(beta);
+    typename coef_arg<double, A>::type sa = coef_arg<double, A>::get(alpha);
+    typename coef_arg<double, B>::type sb = coef_arg<double, B>::get(beta);
+
+    V inv = V::zero();
+    for (int c = 0; c < cvec; c += W)
+        inv = inv + Terms::invariant(V::load(&xb[c]), va, vb);
+    double invariant = inv.reduce();
+    for (int c = cvec; c < cols; c++)
+        invariant = invariant + Terms::invariant(xb[c], sa, sb);
+
+    for (int r = 0; r < rows; r++) {
+        const double* ar = a + (size_t)r * lda;
+        V acc[ACC];
+        int c = 0;
+
+        for (int k = 0; k < ACC; k++)
+            acc[k] = V::zero();
+        for (; c + ACC * W <= cvec; c += ACC * W)
+            for (int k = 0; k < ACC; k++)
+                acc[k] = acc[k] + Terms::row(V::load(&ar[c + k * W]), V::load(&xb[c + k * W]), va, vb);
+        for (; c < cvec; c += W)
+            acc[0] = acc[0] + Terms::row(V::load(&ar[c]), V::load(&xb[c]), va, vb);
+
+        for (int half = ACC / 2; half > 0; half /= 2)
+            for (int k = 0; k < half; k++)
+                acc[k] = acc[k] + acc[k + half];
+        double sum = acc[0].reduce();
+        for (; c < cols; c++)
+            sum = sum + Terms::row(ar[c], xb[c], sa, sb);
+        sums[r] += sum + invariant;
+    }
+}
+
+// Kernel descriptions
+
+// routine1: y = y - alpha + beta - z
+struct routine1_update {
+    template <class V, class A, class B>
+    static inline V apply(const V& y, const V& z, const A& alpha, const B& beta) {
+        return y - alpha + beta - z;
+    }
+};
+
+// routine2: w[i] += sum_j (beta * x[j] + alpha * A[i][j] * x[j])
+struct routine2_terms {
+    template <class V, class A, class B>
+    static inline auto invariant(const V& x, const A& /* alpha */, const B& beta) -> decltype(beta * x) {
+        return beta * x;
+    }
+    template <class V, class A, class B>
+    static inline auto row(const V& a, const V& x, const A& alpha, const B& /* beta */) -> decltype(alpha * a * x) {
+        return alpha * a * x;
+    }
+};
+
+// Per instruction set instantiations. FLATTEN inlines the whole template
+// chain into each wrapper so it is compiled for that wrapper's target.
+
+template <class A, class B>
+static TARGET_SSE42 FLATTEN void routine1_fused_sse42(float* yv, const float* zv, size_t n, A alpha, B beta) {
+    fused_elementwise<isa_sse42, routine1_update>(yv, zv, n, alpha, beta);
+}
+
+template <class A, class B>
+static TARGET_AVX2 FLATTEN void routine1_fused_avx2(float* yv, const float* zv, size_t n, A alpha, B beta) {
+    fused_elementwise<isa_avx2, routine1_update>(yv, zv, n, alpha, beta);
+}
+
+template <class A, class B>
+static TARGET_AVX512 FLATTEN void routine1_fused_avx512(float* yv, const float* zv, size_t n, A alpha, B beta) {
+    fused_elementwise<isa_avx512, routine1_update>(yv, zv, n, alpha, beta);
+}
+
+static TARGET_SSE42 FLATTEN void routine1_steps_sse42(float* yv, const float* zv, size_t n, float alpha, float beta,
+                                                     int steps) {
+    fused_elementwise_steps<isa_sse42, routine1_update>(yv, zv, n, alpha, beta, steps);
+}
+
+static TARGET_AVX2 FLATTEN void routine1_steps_avx2(float* yv, const float* zv, size_t n, float alpha, float beta,
+                                                   int steps) {
+    fused_elementwise_steps<isa_avx2, routine1_update>(yv, zv, n, alpha, beta, steps);
+}
+
+static TARGET_AVX512 FLATTEN void routine1_steps_avx512(float* yv, const float* zv, size_t n, float alpha, float beta,
+                                                       int steps) {
+    fused_elementwise_steps<isa_avx512, routine1_update>(yv, zv, n, alpha, beta, steps);
+}
+
+template <int ACC, class A, class B>
+static TARGET_SSE42 FLATTEN void routine2_fused_sse42(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                                      A alpha, B beta, double* sums) {
+    fused_rowreduce<isa_sse42, routine2_terms, ACC>(a, lda, rows, xb, cols, alpha, beta, sums);
+}
+
+template <int ACC, class A, class B>
+static TARGET_AVX2 FLATTEN void routine2_fused_avx2(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                                    A alpha, B beta, double* sums) {
+    fused_rowreduce<isa_avx2, routine2_terms, ACC>(a, lda, rows, xb, cols, alpha, beta, sums);
+}
+
+template <int ACC, class A, class B>
+static TARGET_AVX512 FLATTEN void routine2_fused_avx512(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                                        A alpha, B beta, double* sums) {
+    fused_rowreduce<isa_avx512, routine2_terms, ACC>(a, lda, rows, xb, cols, alpha, beta, sums);
+}
+
+template <class A, class B>
+static void routine1_fused_isa(unsigned int M, A alpha, B beta) {
+    if (kernel_level == 2)
+        routine1_fused_avx512(y, z, M, alpha, beta);
+    else if (kernel_level == 1)
+        routine1_fused_avx2(y, z, M, alpha, beta);
+    else
+        routine1_fused_sse42(y, z, M, alpha, beta);
+}
+
+template <class A, class B>
+static void routine2_fused_isa(unsigned int N, A alpha, B beta) {
+    if (kernel_level == 2)
+        routine2_fused_avx512<2>(A_data, lda, (int)N, x, (int)N, alpha, beta, w);
+    else if (kernel_level == 1)
+        routine2_fused_avx2<2>(A_data, lda, (int)N, x, (int)N, alpha, beta, w);
+    else
+        routine2_fused_sse42<2>(A_data, lda, (int)N, x, (int)N, alpha, beta, w);
+}
+
+// routine1_vec generated from routine1_update. Coefficients that are zero at
+// run time select a specialization with their term compiled out.
+void routine1_fused(float alpha, float beta, unsigned int M) {
+
+    if (alpha == 0.0f && beta == 0.0f)
+        routine1_fused_isa(M, coef_zero(), coef_zero());
+    else if (alpha == 0.0f)
+        routine1_fused_isa(M, coef_zero(), beta);
+    else if (beta == 0.0f)
+        routine1_fused_isa(M, alpha, coef_zero());
+    else
+        routine1_fused_isa(M, alpha, beta);
+}
+
+// routine2_vec generated from routine2_terms, with beta * sum(x) hoisted out of
+// the row loop. alpha of 0 or 1 and beta of 0 are specialized at compile time.
+void routine2_fused(float alpha, float beta, unsigned int N) {
+
+    const double a = alpha, b = beta;
+
+    if (b == 0.0) {
+        if (a == 0.0)
+            routine2_fused_isa(N, coef_zero(), coef_zero());
+        else if (a == 1.0)
+            routine2_fused_isa(N, coef_one(), coef_zero());
+        else
+            routine2_fused_isa(N, a, coef_zero());
+    }
+    else {
+        if (a == 0.0)
+            routine2_fused_isa(N, coef_zero(), b);
+        else if (a == 1.0)
+            routine2_fused_isa(N, coef_one(), b);
+        else
+            routine2_fused_isa(N, a, b);
+    }
+}
+
+/*------------------------------ Kernel dispatch ------------------------------*/
+
+typedef void (*routine1_kernel_t)(float* yv, const float* zv, size_t n, float alpha, float beta, bool stream);
+typedef void (*routine2_block_kernel_t)(const double* a, size_t lda, int rows, const double* xb, int cols,
+                                        double alpha, double beta, double* sums);
+typedef void (*routine2_block_f32_kernel_t)(const float* a, size_t lda, int rows, const double* xb, int cols,
+                                            double alpha, double beta, double* sums);
+typedef double (*routine2_row_det_kernel_t)(const double* a, const double* xv, int n, double alpha, double beta);
+typedef void (*routine2_batch_block_kernel_t)(const double* a, size_t lda, int rows, const double* const* xs,
+                                              int col, int cols, int K, double* dots);
+typedef void (*routine2_block_bf16_kernel_t)(const uint16_t* a, size_t lda, int rows, const double* xb, int cols,
+                                             double alpha, double beta, double* sums);
+
+static routine1_kernel_t routine1_kernel = routine1_sse42;
+static routine2_block_kernel_t routine2_block_kernel = routine2_block_sse42;
+static routine2_batch_block_kernel_t routine2_batch_block_kernel = routine2_batch_block_scalar;
+static routine2_row_det_kernel_t routine2_row_det_kernel = routine2_row_det_sse42;
+static routine2_block_f32_kernel_t routine2_block_f32_kernel = routine2_block_lowp_scalar<float>;
+static routine2_block_bf16_kernel_t routine2_block_bf16_kernel = routine2_block_lowp_scalar<uint16_t>;
+
+static void cpuid(int leaf, int subleaf, unsigned int regs[4]) {
+#if defined(_MSC_VER)
+    __cpuidex((int*)regs, leaf, subleaf);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Returns the XCR0 register, i.e. which register states the OS saves on context switch
+static unsigned long long read_xcr0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned int lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+
+// Pick the widest kernels supported by both the CPU and the OS.
+// Setting KERNEL_ISA=sse42|avx2|avx512 in the environment caps the choice.
+void select_kernels() {
+
+    unsigned int regs[4];
+    bool has_avx2 = false, has_avx512 = false;
+
+    cpuid(0, 0, regs);
+    unsigned int max_leaf = regs[0];
+
+    cpuid(1, 0, regs);
+    bool has_osxsave = (regs[2] >> 27) & 1;
+    bool has_fma = (regs[2] >> 12) & 1;
+
+    if (has_osxsave && max_leaf >= 7) {
+        unsigned long long xcr0 = read_xcr0();
+        bool ymm_enabled = (xcr0 & 0x6) == 0x6;   // SSE and AVX state
+        bool zmm_enabled = (xcr0 & 0xe6) == 0xe6; // plus opmask and upper ZMM state
+
+        cpuid(7, 0, regs);
+        has_avx2 = ymm_enabled && has_fma && ((regs[1] >> 5) & 1);
+        has_avx512 = zmm_enabled && has_avx2 && ((regs[1] >> 16) & 1);
+    }
+
+    const char* cap = getenv("KERNEL_ISA");
+    if (cap && strcmp(cap, "sse42") == 0)
+        has_avx2 = has_avx512 = false;
+    else if (cap && strcmp(cap, "avx2") == 0)
+        has_avx512 = false;
+
+    if (has_avx512) {
+        routine1_kernel = routine1_avx512;
+        routine2_block_kernel = routine2_block_avx512;
+        routine2_block_f32_kernel = routine2_block_lowp_avx512<float>;
+        routine2_block_bf16_kernel = routine2_block_lowp_avx512<uint16_t>;
+        routine2_batch_block_kernel = routine2_batch_block_avx512;
+        routine2_row_det_kernel = routine2_row_det_avx512;
+        kernel_isa = "AVX-512";
+        kernel_level = 2;
+    }
+    else if (has_avx2) {
+        routine1_kernel = routine1_avx2;
+        routine2_block_kernel = routine2_block_avx2;
+        routine2_block_f32_kernel = routine2_block_lowp_avx2<float>;
+        routine2_block_bf16_kernel = routine2_block_lowp_avx2<uint16_t>;
+        routine2_batch_block_kernel = routine2_batch_block_avx2;
+        routine2_row_det_kernel = routine2_row_det_avx2;
+        kernel_isa = "AVX2+FMA";
+        kernel_level = 1;
+    }
+    else {
+        routine1_kernel = routine1_sse42;
+        routine2_block_kernel = routine2_block_sse42;
+        routine2_block_f32_kernel = routine2_block_lowp_scalar<float>;
+        routine2_block_bf16_kernel = routine2_block_lowp_scalar<uint16_t>;
+        routine2_batch_block_kernel = routine2_batch_block_scalar;
+        routine2_row_det_kernel = routine2_row_det_sse42;
+        kernel_isa = "SSE4.2";
+        kernel_level = 0;
+    }
+}
+
+// fp64 routine2 block kernel for instruction set level 0-2: the hand-written
+// four-row kernel when accumulators is 0, otherwise the fused template kernel
+// with that many accumulator chains per row (1, 2, 4 or 8)
+static routine2_block_kernel_t routine2_block_variant(int level, int accumulators) {
+
+    static const routine2_block_kernel_t builtin[3] = { routine2_block_sse42, routine2_block_avx2, routine2_block_avx512 };
+    static const routine2_block_kernel_t fused[3][4] = {
+        { routine2_fused_sse42<1, double, double>, routine2_fused_sse42<2, double, double>,
+          routine2_fused_sse42<4, double, double>, routine2_fused_sse42<8, double, double> },
+        { routine2_fused_avx2<1, double, double>, routine2_fused_avx2<2, double, double>,
+          routine2_fused_avx2<4, double, double>, routine2_fused_avx2<8, double, double> },
+        { routine2_fused_avx512<1, double, double>, routine2_fused_avx512<2, double, double>,
+          routine2_fused_avx512<4, double, double>, routine2_fused_avx512<8, double, double> }
+    };
+
+    if (accumulators <= 0)
+        return builtin[level];
+    return fused[level][accumulators >= 8 ? 3 : (accumulators >= 4 ? 2 : (accumulators >= 2 ? 1 : 0))];
+}
+
+// Team size for a parallel routine: the tuned count, or the OpenMP default.
+// NUMA placement is laid out for the default team, so that always uses it.
+static int team_size(int tuned) {
+    return tuned > 0 && !numa_mode ? tuned : omp_get_max_threads();
+}
+
+void routine1_vec(float alpha, float beta, unsigned int M) {
+    routine1_kernel(y, z, M, alpha, beta, false);
+}
+
+// Parallel streaming version of routine1_vec. Each thread updates one
+// cache-line aligned slice of y; once y and z together exceed the last level
+// cache the kernels switch to non-temporal stores.
+void routine1_par(float alpha, float beta, unsigned int M) {
+
+#pragma omp parallel num_threads(team_size(tuning.r1_threads))
+    routine1_share(alpha, beta, M, omp_get_thread_num(), omp_get_num_threads());
+}
+
+// Whether routine1_par streams: y and z together exceed the last level cache
+bool routine1_streams(unsigned int M) {
+    return 2 * (size_t)M * sizeof(float) > llc_size();
+}
+
+// The part of routine1_par done by thread tid of nthreads
+void routine1_share(float alpha, float beta, unsigned int M, int tid, int nthreads) {
+
+    const bool stream = routine1_streams(M);
+    size_t begin, end;
+    thread_range(M, 16, tid, nthreads, &begin, &end);
+
+    if (begin < end)
+        routine1_kernel(&y[begin], &z[begin], end - begin, alpha, beta, stream);
+}
+
+const char* precision_name(matrix_precision p) {
+    return p == PREC_FP32 ? "fp32" : (p == PREC_BF16 ? "bf16" : "fp64");
+}
+
+size_t matrix_element_size(matrix_precision p) {
+    return p == PREC_FP32 ? sizeof(float) : (p == PREC_BF16 ? sizeof(uint16_t) : sizeof(double));
+}
+
+// Run the block kernel for the storage selected by a_precision on rows
+// [row, row + rows) and columns [col, col + cols) of A, with x read from xv
+static void routine2_block(const double* xv, size_t row, int rows, int col, int cols, double alpha, double beta,
+                           double* sums) {
+
+    size_t offset = row * lda + col;
+
+    if (a_precision == PREC_FP32)
+        routine2_block_f32_kernel(A_f32 + offset, lda, rows, &xv[col], cols, alpha, beta, sums);
+    else if (a_precision == PREC_BF16)
+        routine2_block_bf16_kernel(A_bf16 + offset, lda, rows, &xv[col], cols, alpha, beta, sums);
+    else
+        routine2_block_kernel(A_data + offset, lda, rows, &xv[col], cols, alpha, beta, sums);
+}
+
+void routine2_vec(float alpha, float beta, unsigned int N) {
+
+    for (unsigned int i = 0; i < N; i++)
+        routine2_block_kernel(A[i], 0, 1, x, (int)N, alpha, beta, &w[i]);
+}
+
+static void routine2_share_steps(float alpha, float beta, unsigned int N, int tid, int nthreads, int steps);
+
+// Parallel, cache-blocked version of routine2_vec over the contiguous matrix
+// (A_data, or its reduced-precision copy when a_precision is not PREC_FP64).
+// Rows are split statically across the OpenMP threads. Each thread walks x in
+// blocks of tuning.r2_jblock columns so the block stays in L1 while it is
+// reused for every row the thread owns. With a tuned row block the thread's
+// rows are processed that many at a time, each over all column blocks, which
+// keeps the partial sums in L1 as well. In NUMA mode x is first copied to the
+// replica on every node, and each thread reads the replica on its own node.
+void routine2_par(float alpha, float beta, unsigned int N) {
+
+    if (numa_mode)
+        numa_replicate_x(N);
+
+#pragma omp parallel num_threads(team_size(tuning.r2_threads))
+    routine2_share(alpha, beta, N, omp_get_thread_num(), omp_get_num_threads());
+}
+
+// The part of routine2_par done by thread tid of nthreads. The NUMA replicas
+// of x are only used when the team is the one the data was placed for.
+void routine2_share(float alpha, float beta, unsigned int N, int tid, int nthreads) {
+    routine2_share_steps(alpha, beta, N, tid, nthreads, 1);
+}
+
+// routine2_share for `steps` repeated, identical calls. Nothing feeds w back
+// into x, so every call adds the same row sums: they are computed once and
+// added to w `steps` times in the order separate calls would add them. This
+// skips work rather than blocking it, so it is no measure of how dependent
+// steps would run.
+static void routine2_share_steps(float alpha, float beta, unsigned int N, int tid, int nthreads, int steps) {
+
+    const int n = (int)N;
+    const int jblock = tuning.r2_jblock;
+    const bool replica = numa_mode && nthreads == (int)numa_thread_node.size();
+    const double* xv = replica ? x_node[numa_thread_node[tid]] : x;
+    size_t begin, end;
+    thread_range(N, 1, tid, nthreads, &begin, &end);
+    const int row_begin = (int)begin;
+    const int row_end = (int)end;
+
+    if (r2_reduction == REDUCE_DETERMINISTIC) {
+        // Whole rows in a fixed order; only fp64 storage is supported
+        for (int i = row_begin; i < row_end; i++) {
+            const double sum = routine2_row_det_kernel(A_data + (size_t)i * lda, xv, n, alpha, beta);
+            for (int t = 0; t < steps; t++)
+                w[i] += sum;
+        }
+        return;
+    }
+
+    if (row_begin < row_end) {
+        // Partial sums for the rows this thread owns, in the arena so nothing
+        // is allocated inside the timed kernel
+        double* w_sum = w_part + row_begin;
+        for (int i = row_begin; i < row_end; i++)
+            w_sum[i - row_begin] = 0.0;
+
+        const int rowblock = tuning.r2_rowblock > 0 ? tuning.r2_rowblock : row_end - row_begin;
+        for (int rb = row_begin; rb < row_end; rb += rowblock) {
+            const int rows = rb + rowblock < row_end ? rowblock : row_end - rb;
+            for (int jb = 0; jb < n; jb += jblock) {
+                const int cols = jb + jblock < n ? jblock : n - jb;
+                routine2_block(xv, rb, rows, jb, cols, alpha, beta, w_sum + (rb - row_begin));
+            }
+        }
+
+        for (int i = row_begin; i < row_end; i++)
+            for (int t = 0; t < steps; t++)
+                w[i] += w_sum[i - row_begin];
+    }
+}
+
+// `steps` consecutive routine1_par calls in one pass over y and z: each
+// element is loaded once and all steps are applied to it in a register
+void routine1_steps(float alpha, float beta, unsigned int M, int steps) {
+
+#pragma omp parallel num_threads(team_size(tuning.r1_threads))
+    {
+        size_t begin, end;
+        thread_range(M, 16, omp_get_thread_num(), omp_get_num_threads(), &begin, &end);
+
+        if (begin < end) {
+            if (kernel_level == 2)
+                routine1_steps_avx512(&y[begin], &z[begin], end - begin, alpha, beta, steps);
+            else if (kernel_level == 1)
+                routine1_steps_avx2(&y[begin], &z[begin], end - begin, alpha, beta, steps);
+            else
+                routine1_steps_sse42(&y[begin], &z[begin], end - begin, alpha, beta, steps);
+        }
+    }
+}
+
+// `steps` repeated routine2_par calls with a single pass over A (see
+// routine2_share_steps: the steps are identical, not dependent)
+void routine2_steps(float alpha, float beta, unsigned int N, int steps) {
+
+    if (numa_mode)
+        numa_replicate_x(N);
+
+#pragma omp parallel num_threads(team_size(tuning.r2_threads))
+    routine2_share_steps(alpha, beta, N, omp_get_thread_num(), omp_get_num_threads(), steps);
+}
+
+// Runs `steps` consecutive routine1_par and routine2_par calls, then the same
+// with routine1_steps/routine2_steps from the same initial data, and checks
+// that both give the same result bit for bit. Only routine1 steps depend on
+// each other, so only routine1 gets a speedup; routine2_steps computes the
+// repeated row sums once and its time is reported without a ratio.
+int run_steps(unsigned int M, unsigned int N, float alpha, float beta, int steps) {
+
+    allocate_arrays(M, N);
+    initialize(M, N);
+
+    double start_time = omp_get_wtime();
+    for (int t = 0; t < steps; t++)
+        routine1_par(alpha, beta, M);
+    double r1_sequential = omp_get_wtime() - start_time;
+
+    start_time = omp_get_wtime();
+    for (int t = 0; t < steps; t++)
+        routine2_par(alpha, beta, N);
+    double r2_sequential = omp_get_wtime() - start_time;
+
+    std::vector<float> y_seq(y, y + M);
+    std::vector<double> w_seq(w, w + N);
+    initialize(M, N);
+
+    start_time = omp_get_wtime();
+    routine1_steps(alpha, beta, M, steps);
+    double r1_blocked = omp_get_wtime() - start_time;
+
+    start_time = omp_get_wtime();
+    routine2_steps(alpha, beta, N, steps);
+    double r2_blocked = omp_get_wtime() - start_time;
+
+    bool r1_same = memcmp(y, y_seq.data(), (size_t)M * sizeof(float)) == 0;
+    bool r2_same = memcmp(w, w_seq.data(), (size_t)N * sizeof(double)) == 0;
+
+    printf("\n%d steps (%d threads, %s kernels, %s matrix):", steps, omp_get_max_threads(), kernel_isa,
+           precision_name(a_precision));
+    printf("\n Routine1: %f secs for %d routine1_par calls, %f secs temporally blocked (%.2fx), %s", r1_sequential,
+           steps, r1_blocked, r1_sequential / r1_blocked, r1_same ? "bit-identical" : "DIFFERENT");
+    printf("\n Routine2: %f secs for %d routine2_par calls, %f secs for the same %d identical steps with the row sums "
+           "computed once, %s\n", r2_sequential, steps, r2_blocked, steps, r2_same ? "bit-identical" : "DIFFERENT");
+
+    free_arrays();
+    return r1_same && r2_same ? 0 : 1;
+}
+
+// routine2_par with the deterministic reduction, whatever r2_reduction says
+void routine2_det(float alpha, float beta, unsigned int N) {
+
+    reduction_mode saved = r2_reduction;
+    r2_reduction = REDUCE_DETERMINISTIC;
+    routine2_par(alpha, beta, N);
+    r2_reduction = saved;
+}
+
+// Called after a deterministic routine2_par run that took det_time seconds.
+// Times the fast reduction on the same input for comparison, and reruns the
+// deterministic one on a single thread with the SSE4.2 kernel to confirm that
+// the result is the same bit for bit.
+void compare_reductions(float alpha, float beta, unsigned int N, double det_time) {
+
+    std::vector<double> w_det(w, w + N);
+    const int team = team_size(tuning.r2_threads);
+
+    // Start again from the w that initialize() sets up
+    for (unsigned int i = 0; i < N; i++)
+        w[i] = (i % 5) - 0.002;
+    r2_reduction = REDUCE_FAST;
+    double start_time = omp_get_wtime();
+    routine2_par(alpha, beta, N);
+    double fast_time = omp_get_wtime() - start_time;
+    r2_reduction = REDUCE_DETERMINISTIC;
+
+    for (unsigned int i = 0; i < N; i++)
+        w[i] = (i % 5) - 0.002;
+    routine2_row_det_kernel_t saved = routine2_row_det_kernel;
+    routine2_row_det_kernel = routine2_row_det_sse42;
+    routine2_share(alpha, beta, N, 0, 1);
+    routine2_row_det_kernel = saved;
+    bool identical = memcmp(w, w_det.data(), N * sizeof(double)) == 0;
+
+    printf("\n Deterministic reduction %f secs, fast reduction %f secs (%+.0f%%)", det_time, fast_time,
+           100.0 * (det_time - fast_time) / fast_time);
+    printf("\n Single-thread SSE4.2 rerun is %s the %d-thread %s result\n",
+           identical ? "bit-identical to" : "DIFFERENT from", team, kernel_isa);
+
+    memcpy(w, w_det.data(), N * sizeof(double));
+}
+
+// Batched routine2: for k < K, W[k][i] += sum_j (beta * X[k][j] + alpha * A[i][j] * X[k][j]).
+// All K products are formed in one pass over A_data, so the matrix is read
+// once per batch instead of once per vector. beta * sum_j X[k][j] is the same
+// for every row and is computed once per vector. The per-row products go to
+// w_part, so K may not exceed the w_part_width it was allocated with.
+void routine2_batch(float alpha, float beta, unsigned int N, unsigned int K, const double* const* X, double* const* W) {
+
+    const int n = (int)N;
+    const int kb = (int)K;
+
+    if (K > w_part_width) {
+        fprintf(stderr, "routine2_batch: %u vectors, but w_part was allocated for %u\n", K, w_part_width);
+        exit(EXIT_FAILURE);
+    }
+
+    // Keep the K blocks of x in L1/L2 together
+    int jblock = R2_JBLOCK / (kb > 0 ? kb : 1);
+    jblock = jblock < 64 ? 64 : jblock & ~7;
+
+    std::vector<double> beta_sum(K);
+    for (unsigned int k = 0; k < K; k++) {
+        double sum = 0.0;
+        for (unsigned int j = 0; j < N; j++)
+            sum += X[k][j];
+        beta_sum[k] = beta * sum;
+    }
+
+#pragma omp parallel
+    {
+        size_t begin, end;
+        thread_range(N, 1, omp_get_thread_num(), omp_get_num_threads(), &begin, &end);
+        const int rows = (int)(end - begin);
+
+        if (rows > 0) {
+            // dots[r * K + k] accumulates row begin + r of A times X[k]
+            double* dots = w_part + begin * K;
+            for (size_t r = 0; r < (size_t)rows * K; r++)
+                dots[r] = 0.0;
+
+            for (int jb = 0; jb < n; jb += jblock) {
+                const int cols = jb + jblock < n ? jblock : n - jb;
+                routine2_batch_block_kernel(A_data + begin * lda + jb, lda, rows, X, jb, cols, kb, dots);
+            }
+
+            for (int r = 0; r < rows; r++)
+                for (int k = 0; k < kb; k++)
+                    W[k][begin + r] += alpha * dots[(size_t)r * K + k] + beta_sum[k];
+        }
+    }
+}
+
+// Runs routine2_batch on K generated vectors, compares it with K calls of
+// routine2_par and checks every output against the scalar routine2 formula.
+void run_routine2_batch(float alpha, float beta, unsigned int N, unsigned int K) {
+
+    std::vector<double*> X(K), W(K), W_single(K);
+    double start_time, batch_time, single_time;
+
+    for (unsigned int k = 0; k < K; k++) {
+        X[k] = (double*)_aligned_malloc(N * sizeof(double), 64);
+        W[k] = (double*)_aligned_malloc(N * sizeof(double), 64);
+        W_single[k] = (double*)_aligned_malloc(N * sizeof(double), 64);
+        for (unsigned int i = 0; i < N; i++) {
+            X[k][i] = ((i + k) % 19) - 0.01;
+            W[k][i] = (i % 5) - 0.002;
+            W_single[k][i] = W[k][i];
+        }
+    }
+
+    printf("\nRoutine2 batch of %u vectors (%d threads):", K, omp_get_max_threads());
+    start_time = omp_get_wtime();
+    routine2_batch(alpha, beta, N, K, X.data(), W.data());
+    batch_time = omp_get_wtime() - start_time;
+
+    // Same work as K separate matrix-vector products, for comparison
+    double* x_saved = x;
+    double* w_saved = w;
+    start_time = omp_get_wtime();
+    for (unsigned int k = 0; k < K; k++) {
+        x = X[k];
+        w = W_single[k];
+        routine2_par(alpha, beta, N);
+    }
+    single_time = omp_get_wtime() - start_time;
+    x = x_saved;
+    w = w_saved;
+
+    printf("\n Time elapsed is %f secs (%f secs for %u routine2_par calls) \n", batch_time, single_time, K);
+
+    // Reference: apply the routine2 formula to each vector from its initial
+    // value. The sums grow with N, so the bound is relative, as in
+    // check_correctness_routine2.
+    bool passed = true;
+    double max_rel = 0.0;
+    for (unsigned int k = 0; k < K && passed; k++) {
+        for (unsigned int i = 0; i < N && passed; i++) {
+            double expected = (i % 5) - 0.002;
+            for (unsigned int j = 0; j < N; j++)
+                expected += beta * X[k][j] + alpha * A[i][j] * X[k][j];
+
+            double abs_err = fabs(W[k][i] - expected);
+            double rel_err = expected != 0.0 ? abs_err / fabs(expected) : abs_err;
+            max_rel = rel_err > max_rel ? rel_err : max_rel;
+            if (rel_err > 1e-12) {
+                printf("\nRoutine2_batch failed at vector %u, index %u: w_batch=%f, w_ref=%f\n", k, i, W[k][i], expected);
+                passed = false;
+            }
+        }
+    }
+    printf("\n Max relative error %g", max_rel);
+    if (passed)
+        printf("\nRoutine2_batch passed the correctness test!\n");
+
+    for (unsigned int k = 0; k < K; k++) {
+        _aligned_free(X[k]);
+        _aligned_free(W[k]);
+        _aligned_free(W_single[k]);
+    }
+}
+
+/*------------------------------- Verification --------------------------------*/
+
+// Indices to verify: every index for full and golden checks, otherwise
+// verify_samples distinct indices drawn with a fixed-seed xorshift generator
+// so that a failure can be reproduced.
+static std::vector<unsigned int> verification_indices(unsigned int n) {
+
+    std::vector<unsigned int> idx;
+
+    if (verify == VERIFY_SAMPLE && verify_samples < n) {
+        unsigned long long state = 0x9e3779b97f4a7c15ull ^ n;
+        std::vector<bool> picked(n, false);
+        while (idx.size() < verify_samples) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            unsigned int i = (unsigned int)(state % n);
+            if (!picked[i]) {
+                picked[i] = true;
+                idx.push_back(i);
+            }
+        }
+        std::sort(idx.begin(), idx.end());
+    }
+    else {
+        idx.resize(n);
+        for (unsigned int i = 0; i < n; i++)
+            idx[i] = i;
+    }
+    return idx;
+}
+
+// Golden outputs live in golden_dir as <name>_<size>_<alpha>_<beta>.bin, with
+// the coefficients written as raw IEEE bits so the key is exact
+static void golden_path(char* path, size_t len, const char* name, unsigned int size, float alpha, float beta) {
+
+    unsigned int a_bits, b_bits;
+    memcpy(&a_bits, &alpha, sizeof(a_bits));
+    memcpy(&b_bits, &beta, sizeof(b_bits));
+    snprintf(path, len, "%s/%s_%u_%08x_%08x.bin", golden_dir, name, size, a_bits, b_bits);
+}
+
+static bool load_golden(const char* path, void* data, size_t bytes) {
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL)
+        return false;
+
+    bool ok = fread(data, 1, bytes, f) == bytes && fgetc(f) == EOF;
+    fclose(f);
+    return ok;
+}
+
+static void save_golden(const char* path, const void* data, size_t bytes) {
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL || fwrite(data, 1, bytes, f) != bytes)
+        fprintf(stderr, "Unable to write golden output %s\n", path);
+    if (f != NULL)
+        fclose(f);
+}
+
+static const char* verify_name() {
+    return verify == VERIFY_FULL ? "full" : (verify == VERIFY_SAMPLE ? "sampled" : "golden");
+}
+
+void check_correctness_routine1(float alpha, float beta, unsigned int M) {
+
+    double start_time = omp_get_wtime();
+    std::vector<unsigned int> idx = verification_indices(M);
+    char path[1024];
+
+    if (verify == VERIFY_SAMPLE) {
+        // Scalar reference for the sampled elements only
+        for (size_t k = 0; k < idx.size(); k++)
+            y_ref[idx[k]] = y_ref[idx[k]] - alpha + beta - z[idx[k]];
+    }
+    else if (verify == VERIFY_GOLDEN) {
+        golden_path(path, sizeof(path), "routine1", M, alpha, beta);
+        if (!load_golden(path, y_ref, (size_t)M * sizeof(float))) {
+            routine1(alpha, beta, M);
+            save_golden(path, y_ref, (size_t)M * sizeof(float));
+            printf("\n Saved golden output %s", path);
+        }
+    }
+    else {
+        routine1(alpha, beta, M);
+    }
+
+    printf("\n Verified %u of %u elements (%s) in %f secs", (unsigned int)idx.size(), M, verify_name(),
+           omp_get_wtime() - start_time);
+
+    for (size_t k = 0; k < idx.size(); k++) {
+        unsigned int i = idx[k];
+        if (fabs(y[i] - y_ref[i]) > 1e-6) {
+            printf("\nRoutine1_vec failed at index %d: y_vec=%f, y_ref=%f\n", i, y[i], y_ref[i]);
+            return;
+        }
+    }
+
+    printf("\nRoutine1_vec passed the correctness test!\n");
+}
+
+void check_correctness_routine2(float alpha, float beta, unsigned int N) {
+
+    double max_abs = 0.0, max_rel = 0.0;
+    double start_time = omp_get_wtime();
+    std::vector<unsigned int> idx = verification_indices(N);
+    char path[1024];
+
+    // The reference always uses the double matrix. A reduced-precision matrix
+    // is held to a relative bound a few units of its rounding error wide.
+    double rel_tolerance = a_precision == PREC_FP32 ? 1e-6 : 1e-2;
+
+    if (verify == VERIFY_SAMPLE) {
+        // Scalar reference for the sampled rows only, in routine2's order
+        for (size_t k = 0; k < idx.size(); k++) {
+            unsigned int i = idx[k];
+            for (unsigned int j = 0; j < N; j++)
+                w_ref[i] += beta * x[j] + alpha * A[i][j] * x[j];
+        }
+    }
+    else if (verify == VERIFY_GOLDEN) {
+        golden_path(path, sizeof(path), "routine2", N, alpha, beta);
+        if (!load_golden(path, w_ref, (size_t)N * sizeof(double))) {
+            routine2(alpha, beta, N);
+            save_golden(path, w_ref, (size_t)N * sizeof(double));
+            printf("\n Saved golden output %s", path);
+        }
+    }
+    else {
+        routine2(alpha, beta, N);
+    }
+
+    printf("\n Verified %u of %u rows (%s) in %f secs", (unsigned int)idx.size(), N, verify_name(),
+           omp_get_wtime() - start_time);
+
+    for (size_t k = 0; k < idx.size(); k++) {
+        unsigned int i = idx[k];
+        double abs_err = fabs(w[i] - w_ref[i]);
+        double rel_err = w_ref[i] != 0.0 ? abs_err / fabs(w_ref[i]) : abs_err;
+        max_abs = abs_err > max_abs ? abs_err : max_abs;
+        max_rel = rel_err > max_rel ? rel_err : max_rel;
+    }
+
+    printf("\n Max absolute error %g, max relative error %g (%s matrix)", max_abs, max_rel, precision_name(a_precision));
+
+    for (size_t k = 0; k < idx.size(); k++) {
+        unsigned int i = idx[k];
+        double abs_err = fabs(w[i] - w_ref[i]);
+        bool failed = a_precision == PREC_FP64 ? abs_err > 1e-6 : abs_err > rel_tolerance * fabs(w_ref[i]);
+        if (failed) {
+            printf("\nRoutine2_vec failed at index %d: w_vec=%f, w_ref=%f\n", i, w[i], w_ref[i]);
+            return;
+        }
+    }
+
+    printf("\nRoutine2_vec passed the correctness test!\n");
+}
+
+/*---------------------------- Out-of-core routine2 ---------------------------*/
+
+#define OOC_BLOCK_BYTES ((uint64_t)64 * 1024 * 1024) // Matrix bytes per streamed row block
+
+void matrix_unmap(mapped_matrix* m) {
+
+#if defined(_MSC_VER)
+    if (m->data)
+        UnmapViewOfFile(m->data);
+    if (m->mapping)
+        CloseHandle(m->mapping);
+    if (m->file != INVALID_HANDLE_VALUE)
+        CloseHandle(m->file);
+    m->mapping = NULL;
+    m->file = INVALID_HANDLE_VALUE;
+#else
+    if (m->data)
+        munmap((void*)m->data, m->bytes);
+    if (m->fd >= 0)
+        close(m->fd);
+    m->fd = -1;
+#endif
+    m->data = NULL;
+}
+
+// Map a file holding an n x n row-major matrix of doubles (no header, no row
+// padding) read-only. n is derived from the file size.
+bool matrix_map(const char* path, mapped_matrix* m) {
+
+    m->data = NULL;
+    m->n = m->bytes = 0;
+
+#if defined(_MSC_VER)
+    m->mapping = NULL;
+    m->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER size;
+    if (m->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m->file, &size)) {
+        fprintf(stderr, "Unable to open matrix file %s\n", path);
+        matrix_unmap(m);
+        return false;
+    }
+    m->bytes = (uint64_t)size.QuadPart;
+#else
+    struct stat st;
+    m->fd = open(path, O_RDONLY);
+    if (m->fd < 0 || fstat(m->fd, &st) != 0) {
+        fprintf(stderr, "Unable to open matrix file %s\n", path);
+        matrix_unmap(m);
+        return false;
+    }
+    m->bytes = (uint64_t)st.st_size;
+#endif
+
+    // The block kernels take int column counts, which bounds n
+    uint64_t elements = m->bytes / sizeof(double);
+    uint64_t n = (uint64_t)sqrt((double)elements);
+    while (n * n > elements)
+        n--;
+    while ((n + 1) * (n + 1) <= elements)
+        n++;
+    if (n == 0 || n * n * sizeof(double) != m->bytes || n > INT_MAX) {
+        fprintf(stderr, "%s does not hold a square matrix of doubles\n", path);
+        matrix_unmap(m);
+        return false;
+    }
+    m->n = n;
+
+#if defined(_MSC_VER)
+    m->mapping = CreateFileMappingA(m->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    m->data = m->mapping ? (const double*)MapViewOfFile(m->mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+#else
+    void* p = mmap(NULL, m->bytes, PROT_READ, MAP_SHARED, m->fd, 0);
+    m->data = p == MAP_FAILED ? NULL : (const double*)p;
+    if (m->data)
+        madvise(p, m->bytes, MADV_SEQUENTIAL);
+#endif
+    if (m->data == NULL) {
+        fprintf(stderr, "Unable to map matrix file %s\n", path);
+        matrix_unmap(m);
+        return false;
+    }
+    return true;
+}
+
+// Tell the OS that bytes [offset, offset + bytes) of the mapping are needed
+// soon (starts asynchronous read-ahead) or are done with (drops them from the
+// process and the page cache). Only whole pages inside the range are dropped,
+// so rows of the neighbouring block that share a page are kept. Windows gets
+// no hints; its mapped-file read-ahead is left to the OS.
+static void matrix_advise(const mapped_matrix* m, uint64_t offset, uint64_t bytes, bool will_need) {
+
+#if !defined(_MSC_VER)
+    const uint64_t page = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t start = will_need ? offset / page * page : round_up(offset, page);
+    uint64_t end = will_need ? offset + bytes : (offset + bytes) / page * page;
+    if (end <= start)
+        return;
+
+    char* base = (char*)m->data + start;
+    if (will_need) {
+        madvise(base, end - start, MADV_WILLNEED);
+    }
+    else {
+        madvise(base, end - start, MADV_DONTNEED);
+        posix_fadvise(m->fd, (off_t)start, (off_t)(end - start), POSIX_FADV_DONTNEED);
+    }
+#else
+    (void)m;
+    (void)offset;
+    (void)bytes;
+    (void)will_need;
+#endif
+}
+
+// Rows of an n x n matrix file that routine2_ooc multiplies per block
+uint64_t ooc_block_rows(uint64_t n) {
+    const uint64_t row_bytes = n * sizeof(double);
+    const uint64_t rows = OOC_BLOCK_BYTES / row_bytes > 0 ? OOC_BLOCK_BYTES / row_bytes : 1;
+    return rows < n ? rows : n;
+}
+
+// routine2 on a mapped matrix that need not fit in memory:
+// w[i] += sum_j (beta * x[j] + alpha * A[i][j] * x[j]) for all n rows.
+// The file is consumed in row blocks of about OOC_BLOCK_BYTES. Read-ahead of
+// block b + 1 is requested before block b is multiplied, and block b is
+// released afterwards, so about two blocks are resident at any time. Within a
+// block the rows are split across threads and x is walked in column blocks of
+// tuning.r2_jblock, as in routine2_par. All sizes and offsets are 64-bit.
+// sums is scratch for the partial sums of one block, ooc_block_rows(n) long.
+void routine2_ooc(float alpha, float beta, const mapped_matrix* m, const double* xv, double* wv, double* sums) {
+
+    const uint64_t n = m->n;
+    const uint64_t row_bytes = n * sizeof(double);
+    const uint64_t block_rows = ooc_block_rows(n);
+
+    matrix_advise(m, 0, block_rows * row_bytes, true);
+
+    for (uint64_t row = 0; row < n; row += block_rows) {
+        const uint64_t rows = row + block_rows < n ? block_rows : n - row;
+        const uint64_t next = row + rows;
+        const double* block = m->data + row * n;
+
+        if (next < n)
+            matrix_advise(m, next * row_bytes, (next + block_rows < n ? block_rows : n - next) * row_bytes, true);
+
+#pragma omp parallel
+        {
+            size_t begin, end;
+            thread_range(rows, 1, omp_get_thread_num(), omp_get_num_threads(), &begin, &end);
+
+            if (begin < end) {
+                for (size_t i = begin; i < end; i++)
+                    sums[i] = 0.0;
+
+                const uint64_t jblock = (uint64_t)tuning.r2_jblock;
+                for (uint64_t jb = 0; jb < n; jb += jblock) {
+                    const int cols = (int)(jb + jblock < n ? jblock : n - jb);
+                    routine2_block_kernel(block + begin * n + jb, n, (int)(end - begin), &xv[jb], cols,
+                                          alpha, beta, sums + begin);
+                }
+
+                for (size_t i = begin; i < end; i++)
+                    wv[row + i] += sums[i];
+            }
+        }
+
+        matrix_advise(m, row * row_bytes, rows * row_bytes, false);
+    }
+}
+
+// Write the n x n matrix that initialize() generates to a file in the layout
+// matrix_map() expects, one row at a time, so n * n * 8 may exceed memory
+bool write_matrix_file(const char* path, unsigned int n) {
+
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to create matrix file %s\n", path);
+        return false;
+    }
+
+    std::vector<double> col_term(n), row(n);
+    for (unsigned int j = 0; j < n; j++)
+        col_term[j] = (double)(j % 14);
+
+    bool ok = true;
+    for (unsigned int i = 0; i < n && ok; i++) {
+        initialize_matrix_row(row.data(), col_term.data(), (double)(i % 99), n, false);
+        ok = fwrite(row.data(), sizeof(double), n, f) == n;
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok)
+        fprintf(stderr, "Unable to write matrix file %s\n", path);
+    return ok;
+}
+
+// Runs routine2_ooc on the matrix in `path` with x and w initialized as in
+// initialize(), and checks the verified rows against the scalar formula.
+// Golden outputs are keyed by size only, so --verify golden checks every row
+// like --verify full.
+int run_routine2_mapped(const char* path, float alpha, float beta) {
+
+    mapped_matrix m;
+    if (!matrix_map(path, &m))
+        return 1;
+
+    const uint64_t n = m.n;
+    double* xv = (double*)_aligned_malloc(n * sizeof(double), 64);
+    double* wv = (double*)_aligned_malloc(n * sizeof(double), 64);
+    double* sums = (double*)_aligned_malloc(ooc_block_rows(n) * sizeof(double), 64);
+    if (xv == NULL || wv == NULL || sums == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        xv[i] = (i % 19) - 0.01;
+        wv[i] = (i % 5) - 0.002;
+    }
+
+    printf("\nRoutine2 out-of-core on %s (%llu x %llu, %.2f GB, %d threads):", path, (unsigned long long)n,
+           (unsigned long long)n, m.bytes / 1e9, omp_get_max_threads());
+    double start_time = omp_get_wtime();
+    routine2_ooc(alpha, beta, &m, xv, wv, sums);
+    double run_time = omp_get_wtime() - start_time;
+    printf("\n Time elapsed is %f secs, %.2f GB/s from the matrix file \n", run_time, m.bytes / run_time * 1e-9);
+
+    start_time = omp_get_wtime();
+    std::vector<unsigned int> idx = verification_indices((unsigned int)n);
+    double max_rel = 0.0;
+    uint64_t failed = n;
+
+    for (size_t k = 0; k < idx.size(); k++) {
+        const uint64_t i = idx[k];
+        const double* row = m.data + i * n;
+        double expected = (i % 5) - 0.002;
+        for (uint64_t j = 0; j < n; j++)
+            expected += beta * xv[j] + alpha * row[j] * xv[j];
+
+        // The sums grow with n, so the bound is relative here
+        double rel_err = fabs(wv[i] - expected) / (fabs(expected) > 1.0 ? fabs(expected) : 1.0);
+        max_rel = rel_err > max_rel ? rel_err : max_rel;
+        if (rel_err > 1e-12 && failed == n)
+            failed = i;
+    }
+
+    printf("\n Verified %u of %llu rows (%s) in %f secs, max relative error %g", (unsigned int)idx.size(),
+           (unsigned long long)n, verify_name(), omp_get_wtime() - start_time, max_rel);
+    if (failed < n)
+        printf("\nRoutine2_ooc failed at row %llu\n", (unsigned long long)failed);
+    else
+        printf("\nRoutine2_ooc passed the correctness test!\n");
+
+    _aligned_free(xv);
+    _aligned_free(wv);
+    _aligned_free(sums);
+    matrix_unmap(&m);
+    return failed < n ? 1 : 0;
+}
+
+/*-------------------------- Hardware counter probes --------------------------*/
+
+// Counters read around each routine. FP_VECTOR is a vendor specific raw event:
+// FP_ARITH_INST_RETIRED with all packed-width umasks on Intel, and
+// FpRetSseAvxOps on AMD Zen. Any counter the kernel refuses is reported as n/a.
+enum { PC_CYCLES, PC_INSTRUCTIONS, PC_LLC_MISSES, PC_FP_VECTOR, PC_COUNT };
+
+static const char* const counter_names[PC_COUNT] = { "cycles", "instructions", "LLC misses", "FP vector ops" };
+
+// One set of counters per OpenMP thread, since a perf event only counts the
+// thread that opened it. All of them are read from the main thread.
+struct perf_counters {
+    std::vector<int> fd; // fd[thread * PC_COUNT + counter], -1 when unavailable
+    int nthreads;
+};
+
+struct counter_values {
+    double value[PC_COUNT];
+    bool valid[PC_COUNT];
+};
+
+#if defined(__linux__)
+
+static int open_counter(unsigned int type, unsigned long long config) {
+
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1; // Allowed at perf_event_paranoid <= 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    // pid 0, cpu -1: the calling thread on any CPU
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static bool is_amd() {
+    unsigned int regs[4];
+    cpuid(0, 0, regs);
+    return regs[1] == 0x68747541; // "Auth" of "AuthenticAMD"
+}
+
+bool perf_counters_open(perf_counters* pc) {
+
+    const unsigned long long fp_vector = is_amd() ? 0xff03 : 0xfcc7;
+    bool any = false;
+
+    pc->nthreads = omp_get_max_threads();
+    pc->fd.assign((size_t)pc->nthreads * PC_COUNT, -1);
+
+#pragma omp parallel num_threads(pc->nthreads) reduction(|| : any)
+    {
+        int* fd = &pc->fd[(size_t)omp_get_thread_num() * PC_COUNT];
+        fd[PC_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fd[PC_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fd[PC_LLC_MISSES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+        fd[PC_FP_VECTOR] = open_counter(PERF_TYPE_RAW, fp_vector);
+        for (int c = 0; c < PC_COUNT; c++)
+            any = any || fd[c] >= 0;
+    }
+    return any;
+}
+
+// Sum of every thread's counts, scaled up when the kernel had to multiplex
+void perf_counters_read(const perf_counters* pc, counter_values* v) {
+
+    for (int c = 0; c < PC_COUNT; c++) {
+        v->value[c] = 0.0;
+        v->valid[c] = true;
+        for (int t = 0; t < pc->nthreads; t++) {
+            unsigned long long data[3]; // value, time enabled, time running
+            int fd = pc->fd[(size_t)t * PC_COUNT + c];
+            if (fd < 0 || read(fd, data, sizeof(data)) != (ssize_t)sizeof(data)) {
+                v->valid[c] = false;
+                continue;
+            }
+            v->value[c] += data[2] > 0 ? (double)data[0] * data[1] / data[2] : 0.0;
+        }
+    }
+}
+
+void perf_counters_close(perf_counters* pc) {
+    for (size_t k = 0; k < pc->fd.size(); k++)
+        if (pc->fd[k] >= 0)
+            close(pc->fd[k]);
+    pc->fd.clear();
+}
+
+#else
+
+bool perf_counters_open(perf_counters* pc) {
+    pc->nthreads = 0;
+    return false;
+}
+
+void perf_counters_read(const perf_counters* pc, counter_values* v) {
+    for (int c = 0; c < PC_COUNT; c++) {
+        v->value[c] = 0.0;
+        v->valid[c] = false;
+    }
+}
+
+void perf_counters_close(perf_counters* pc) {
+}
+
+#endif
+
+// Counter mode: one warmup and one measured call of each routine, reporting
+// the counter deltas of the measured call
+int run_counters(unsigned int M, unsigned int N, float alpha, float beta) {
+
+    struct {
+        const char* name;
+        void (*routine)(float alpha, float beta, unsigned int size);
+        unsigned int size;
+    } routines[] = {
+        { "routine1", routine1, M },
+        { "routine1_vec", routine1_vec, M },
+        { "routine1_par", routine1_par, M },
+        { "routine2", routine2, N },
+        { "routine2_vec", routine2_vec, N },
+        { "routine2_par", routine2_par, N },
+    };
+    perf_counters pc;
+
+    allocate_arrays(M, N);
+    initialize(M, N);
+
+    if (!perf_counters_open(&pc))
+        printf("\nHardware counters are unavailable (not Linux, or perf_event_paranoid too high); "
+               "reporting time only\n");
+
+    printf("\n%s kernels, %d threads, M=%u, N=%u\n", kernel_isa, omp_get_max_threads(), M, N);
+    printf("%-14s %10s %14s %14s %6s %12s %14s\n", "routine", "time (s)", counter_names[PC_CYCLES],
+           counter_names[PC_INSTRUCTIONS], "IPC", counter_names[PC_LLC_MISSES], counter_names[PC_FP_VECTOR]);
+
+    for (size_t r = 0; r < sizeof(routines) / sizeof(routines[0]); r++) {
+        counter_values before, after;
+        char cells[PC_COUNT][32], ipc[16];
+
+        routines[r].routine(alpha, beta, routines[r].size);
+
+        perf_counters_read(&pc, &before);
+        double start_time = omp_get_wtime();
+        routines[r].routine(alpha, beta, routines[r].size);
+        double run_time = omp_get_wtime() - start_time;
+        perf_counters_read(&pc, &after);
+
+        for (int c = 0; c < PC_COUNT; c++) {
+            if (before.valid[c] && after.valid[c])
+                snprintf(cells[c], sizeof(cells[c]), "%.0f", after.value[c] - before.value[c]);
+            else
+                snprintf(cells[c], sizeof(cells[c]), "n/a");
+        }
+
+        double cycles = after.value[PC_CYCLES] - before.value[PC_CYCLES];
+        double instructions = after.value[PC_INSTRUCTIONS] - before.value[PC_INSTRUCTIONS];
+        if (after.valid[PC_CYCLES] && after.valid[PC_INSTRUCTIONS] && cycles > 0.0)
+            snprintf(ipc, sizeof(ipc), "%.2f", instructions / cycles);
+        else
+            snprintf(ipc, sizeof(ipc), "n/a");
+
+        printf("%-14s %10.6f %14s %14s %6s %12s %14s\n", routines[r].name, run_time, cells[PC_CYCLES],
+               cells[PC_INSTRUCTIONS], ipc, cells[PC_LLC_MISSES], cells[PC_FP_VECTOR]);
+    }
+
+    perf_counters_close(&pc);
+    free_arrays();
+    return 0;
+}
+
+/*--------------------------------- Autotuning --------------------------------*/
+// --autotune measures routine1_par and routine2_par over a small set of
+// parameter values for the given M and N, one parameter at a time with the
+// others held at their best value so far. It stores the winner in a
+// per-host profile, and later runs load the entry closest to their M and N at
+// startup. Profiles are plain text, one line per instruction set and size:
+//     isa M N r2_jblock r2_rowblock r2_accumulators r2_threads r1_threads
+
+#define TUNE_REPS 5 // Timed calls per candidate; the fastest one counts
+
+static void profile_path(char* path, size_t len) {
+
+    if (tune_profile) {
+        snprintf(path, len, "%s", tune_profile);
+        return;
+    }
+
+    char host[256] = "localhost";
+#if defined(_MSC_VER)
+    DWORD host_len = sizeof(host);
+    GetComputerNameA(host, &host_len);
+#else
+    gethostname(host, sizeof(host) - 1);
+    host[sizeof(host) - 1] = '\0';
+#endif
+    snprintf(path, len, "question_1.%s.tune", host);
+}
+
+// The ISA name without spaces or '+', as stored in the profile
+static std::string profile_isa() {
+
+    std::string isa = kernel_isa;
+    isa.erase(std::remove(isa.begin(), isa.end(), ' '), isa.end());
+    std::replace(isa.begin(), isa.end(), '+', '_');
+    return isa;
+}
+
+// Make the routines use the current tuning parameters
+void apply_tuning() {
+    routine2_block_kernel = routine2_block_variant(kernel_level, tuning.r2_accumulators);
+}
+
+// Load the profile entry for the selected instruction set whose sizes are
+// closest to M and N (by ratio). Returns false if there is none.
+bool load_tuning(unsigned int M, unsigned int N) {
+
+    char path[1024], line[256], isa[64];
+    profile_path(path, sizeof(path));
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return false;
+
+    const std::string want = profile_isa();
+    double best = -1.0;
+    unsigned int best_m = 0, best_n = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int m, n;
+        tune_params p;
+        if (line[0] == '#' || sscanf(line, "%63s %u %u %d %d %d %d %d", isa, &m, &n, &p.r2_jblock, &p.r2_rowblock,
+                                     &p.r2_accumulators, &p.r2_threads, &p.r1_threads) != 8)
+            continue;
+        if (want != isa || m == 0 || n == 0 || p.r2_jblock < 8)
+            continue;
+
+        double distance = fabs(log((double)m / M)) + fabs(log((double)n / N));
+        if (best < 0.0 || distance < best) {
+            best = distance;
+            best_m = m;
+            best_n = n;
+            tuning = p;
+        }
+    }
+    fclose(f);
+
+    if (best < 0.0)
+        return false;
+
+    apply_tuning();
+    printf("\nLoaded tuning for M=%u N=%u from %s\n", best_m, best_n, path);
+    return true;
+}
+
+// Replace the profile entry for this instruction set, M and N with `tuning`
+static bool save_tuning(unsigned int M, unsigned int N) {
+
+    char path[1024], line[256], isa[64];
+    profile_path(path, sizeof(path));
+    const std::string want = profile_isa();
+    std::vector<std::string> kept;
+
+    FILE* f = fopen(path, "r");
+    if (f != NULL) {
+        while (fgets(line, sizeof(line), f)) {
+            unsigned int m, n;
+            if (line[0] == '#')
+                continue;
+            if (sscanf(line, "%63s %u %u", isa, &m, &n) == 3 && want == isa && m == M && n == N)
+                continue;
+            kept.push_back(line);
+        }
+        fclose(f);
+    }
+
+    f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Unable to write tuning profile %s\n", path);
+        return false;
+    }
+    fprintf(f, "# isa M N r2_jblock r2_rowblock r2_accumulators r2_threads r1_threads\n");
+    for (size_t k = 0; k < kept.size(); k++)
+        fputs(kept[k].c_str(), f);
+    fprintf(f, "%s %u %u %d %d %d %d %d\n", want.c_str(), M, N, tuning.r2_jblock, tuning.r2_rowblock,
+            tuning.r2_accumulators, tuning.r2_threads, tuning.r1_threads);
+    bool ok = fclose(f) == 0;
+
+    printf("\nSaved tuning to %s\n", path);
+    return ok;
+}
+
+// Fastest of TUNE_REPS calls, after one untimed call
+static double time_routine(void (*routine)(float, float, unsigned int), float alpha, float beta, unsigned int n) {
+
+    routine(alpha, beta, n);
+    double best = 0.0;
+    for (int r = 0; r < TUNE_REPS; r++) {
+        double start_time = omp_get_wtime();
+        routine(alpha, beta, n);
+        double t = omp_get_wtime() - start_time;
+        best = r == 0 || t < best ? t : best;
+    }
+    return best;
+}
+
+// Try every candidate for *param, keep the fastest and report the choices
+static double tune_param(const char* name, int* param, const std::vector<int>& candidates,
+                         void (*routine)(float, float, unsigned int), float alpha, float beta, unsigned int n) {
+
+    int best_value = *param;
+    double best_time = -1.0;
+
+    printf("\n %-16s", name);
+    for (size_t k = 0; k < candidates.size(); k++) {
+        *param = candidates[k];
+        apply_tuning();
+        double t = time_routine(routine, alpha, beta, n);
+        printf(" %d:%.3fms", candidates[k], t * 1e3);
+        if (best_time < 0.0 || t < best_time) {
+            best_time = t;
+            best_value = candidates[k];
+        }
+    }
+    *param = best_value;
+    apply_tuning();
+    printf("  -> %d", best_value);
+    return best_time;
+}
+
+int run_autotune(unsigned int M, unsigned int N, float alpha, float beta) {
+
+    allocate_arrays(M, N);
+    initialize(M, N);
+
+    const double r2_default = time_routine(routine2_par, alpha, beta, N);
+    const double r1_default = time_routine(routine1_par, alpha, beta, M);
+    const int max_threads = omp_get_max_threads();
+
+    // Thread counts: powers of two up to the OpenMP default, and the default.
+    // NUMA placement is laid out for the default team, so it is not tuned there.
+    std::vector<int> threads;
+    for (int t = 1; t < max_threads && !numa_mode; t *= 2)
+        threads.push_back(t);
+    threads.push_back(0);
+
+    // Column blocks below N, plus one block spanning all of x
+    std::vector<int> jblocks;
+    for (int jb = 256; jb < (int)N && jb <= 8192; jb *= 2)
+        jblocks.push_back(jb);
+    jblocks.push_back((int)((N + 7) & ~7u));
+
+    // Row blocks smaller than a thread's share of rows, plus the whole share (0)
+    std::vector<int> rowblocks(1, 0);
+    for (int rb = 8; rb <= 512 && rb < (int)(N / max_threads); rb *= 4)
+        rowblocks.push_back(rb);
+
+    // Accumulators per row: the built-in four-row kernel (0) or the fused kernel
+    std::vector<int> accumulators;
+    accumulators.push_back(0);
+    for (int acc = 1; acc <= 8; acc *= 2)
+        accumulators.push_back(acc);
+
+    printf("\nAutotuning for M=%u N=%u with %s kernels (%s matrix), fastest of %d calls:", M, N, kernel_isa,
+           precision_name(a_precision), TUNE_REPS);
+    printf("\nRoutine2_par:");
+    if (threads.size() > 1)
+        tune_param("threads", &tuning.r2_threads, threads, routine2_par, alpha, beta, N);
+    if (a_precision == PREC_FP64)
+        tune_param("accumulators", &tuning.r2_accumulators, accumulators, routine2_par, alpha, beta, N);
+    tune_param("j-block", &tuning.r2_jblock, jblocks, routine2_par, alpha, beta, N);
+    double r2_time = tune_param("row block", &tuning.r2_rowblock, rowblocks, routine2_par, alpha, beta, N);
+
+    printf("\nRoutine1_par:");
+    double r1_time = threads.size() > 1 ? tune_param("threads", &tuning.r1_threads, threads, routine1_par, alpha, beta, M)
+                                        : r1_default;
+
+    printf("\n\nRoutine2_par %.3f ms (default %.3f ms), routine1_par %.3f ms (default %.3f ms)",
+           r2_time * 1e3, r2_default * 1e3, r1_time * 1e3, r1_default * 1e3);
+
+    // Check that the chosen configuration still computes the right thing
+    initialize(M, N);
+    routine1_par(alpha, beta, M);
+    routine2_par(alpha, beta, N);
+    check_correctness_routine1(alpha, beta, M);
+    check_correctness_routine2(alpha, beta, N);
+
+    bool saved = save_tuning(M, N);
+    free_arrays();
+    return saved ? 0 : 1;
+}
+
+/*---------------------------- Concurrent execution ---------------------------*/
+// --concurrent runs routine1 and routine2 at the same time. They touch disjoint
+// data (y/z against A/x/w), so one OpenMP team is split into groups of
+// consecutive threads, one group per kernel, and each thread is pinned to its
+// own CPU. Groups are sized by each kernel's measured demand: its time alone
+// on the full team. For these bandwidth-bound kernels that time is their
+// memory traffic divided by the bandwidth they achieve, so the group sizes
+// follow their share of the traffic. The report compares the concurrent
+// makespan with running the kernels one after the other.
+
+#define SCHED_REPS 5 // Timed runs per measurement; the fastest one counts
+
+// An independent kernel for the scheduler
+struct sched_task {
+    const char* name;
+    void (*full)(float alpha, float beta, unsigned int n);                      // Whole-team version
+    void (*share)(float alpha, float beta, unsigned int n, int tid, int nthreads); // One thread's part
+    unsigned int n;
+    double bytes;  // Memory traffic per call
+    double alone;  // Fastest time on the full team
+    int threads;   // Threads assigned by schedule_tasks()
+    int first;     // First thread (and CPU slot) of its group
+    double finish; // When its group finished in the last concurrent run
+};
+
+// Give every task at least one thread and split the rest in proportion to
+// its time alone, rounding by largest remainder
+static void schedule_tasks(std::vector<sched_task>& tasks, int nthreads) {
+
+    const int ntasks = (int)tasks.size();
+    const int spare = nthreads > ntasks ? nthreads - ntasks : 0;
+    double total = 0.0;
+    for (int k = 0; k < ntasks; k++)
+        total += tasks[k].alone;
+
+    std::vector<double> remainder(ntasks);
+    int assigned = 0;
+    for (int k = 0; k < ntasks; k++) {
+        double exact = total > 0.0 ? spare * tasks[k].alone / total : (double)spare / ntasks;
+        tasks[k].threads = 1 + (int)exact;
+        remainder[k] = exact - (int)exact;
+        assigned += tasks[k].threads;
+    }
+    while (assigned < ntasks + spare) {
+        int best = (int)(std::max_element(remainder.begin(), remainder.end()) - remainder.begin());
+        tasks[best].threads++;
+        remainder[best] = -1.0;
+        assigned++;
+    }
+
+    for (int k = 0, first = 0; k < ntasks; k++) {
+        tasks[k].first = first;
+        first += tasks[k].threads;
+    }
+}
+
+// Run every task once, all at the same time. Thread t of the team works for
+// the task whose group contains t and, outside NUMA mode (which already pinned
+// the threads), is first pinned to cpus[t]. Returns the makespan.
+static double run_tasks_concurrently(std::vector<sched_task>& tasks, const std::vector<int>& cpus,
+                                     float alpha, float beta) {
+
+    const int nthreads = tasks.back().first + tasks.back().threads;
+    std::vector<double> done(nthreads);
+
+    double start_time = omp_get_wtime();
+#pragma omp parallel num_threads(nthreads)
+    {
+        const int tid = omp_get_thread_num();
+        size_t k = 0;
+        while (tid >= tasks[k].first + tasks[k].threads)
+            k++;
+
+#if defined(__linux__)
+        if (!numa_mode && !cpus.empty()) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[tid % cpus.size()], &set);
+            sched_setaffinity(0, sizeof(set), &set);
+        }
+#else
+        (void)cpus;
+#endif
+        tasks[k].share(alpha, beta, tasks[k].n, tid - tasks[k].first, tasks[k].threads);
+        done[tid] = omp_get_wtime();
+    }
+    double makespan = omp_get_wtime() - start_time;
+
+    for (size_t k = 0; k < tasks.size(); k++) {
+        double last = start_time;
+        for (int t = tasks[k].first; t < tasks[k].first + tasks[k].threads; t++)
+            last = done[t] > last ? done[t] : last;
+        tasks[k].finish = last - start_time;
+    }
+    return makespan;
+}
+
+int run_concurrent(unsigned int M, unsigned int N, float alpha, float beta) {
+
+    allocate_arrays(M, N);
+    initialize(M, N);
+
+    const int nthreads = omp_get_max_threads();
+    std::vector<sched_task> tasks;
+    sched_task r1 = { "routine1_par", routine1_par, routine1_share, M,
+                      3.0 * sizeof(float) * M, 0.0, 0, 0, 0.0 };
+    sched_task r2 = { "routine2_par", routine2_par, routine2_share, N,
+                      (double)N * N * matrix_element_size(a_precision) + 2.0 * sizeof(double) * N, 0.0, 0, 0, 0.0 };
+    tasks.push_back(r1);
+    tasks.push_back(r2);
+
+    // CPUs this process may use, one per thread of the concurrent team
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (int c = 0; c < CPU_SETSIZE; c++)
+            if (CPU_ISSET(c, &allowed))
+                cpus.push_back(c);
+#endif
+
+    // Each kernel alone on the full team, then both back to back
+    double sequential = 0.0;
+    for (size_t k = 0; k < tasks.size(); k++) {
+        tasks[k].full(alpha, beta, tasks[k].n);
+        for (int r = 0; r < SCHED_REPS; r++) {
+            double start_time = omp_get_wtime();
+            tasks[k].full(alpha, beta, tasks[k].n);
+            double t = omp_get_wtime() - start_time;
+            tasks[k].alone = r == 0 || t < tasks[k].alone ? t : tasks[k].alone;
+        }
+    }
+    for (int r = 0; r < SCHED_REPS; r++) {
+        double start_time = omp_get_wtime();
+        for (size_t k = 0; k < tasks.size(); k++)
+            tasks[k].full(alpha, beta, tasks[k].n);
+        double t = omp_get_wtime() - start_time;
+        sequential = r == 0 || t < sequential ? t : sequential;
+    }
+
+    schedule_tasks(tasks, nthreads);
+
+    double concurrent = 0.0;
+    std::vector<double> finish(tasks.size());
+    run_tasks_concurrently(tasks, cpus, alpha, beta);
+    for (int r = 0; r < SCHED_REPS; r++) {
+        double t = run_tasks_concurrently(tasks, cpus, alpha, beta);
+        if (r == 0 || t < concurrent) {
+            concurrent = t;
+            for (size_t k = 0; k < tasks.size(); k++)
+                finish[k] = tasks[k].finish;
+        }
+    }
+
+    const int team = tasks.back().first + tasks.back().threads;
+    printf("\nConcurrent execution (%d threads, %d CPUs available, %s kernels):", team, (int)cpus.size(), kernel_isa);
+    for (size_t k = 0; k < tasks.size(); k++)
+        printf("\n %-14s alone %.3f ms (%.2f GB/s) -> threads %d-%d, done after %.3f ms", tasks[k].name,
+               tasks[k].alone * 1e3, tasks[k].bytes / tasks[k].alone * 1e-9, tasks[k].first,
+               tasks[k].first + tasks[k].threads - 1, finish[k] * 1e3);
+    if (team > nthreads || (!cpus.empty() && team > (int)cpus.size()))
+        printf("\n More threads than available CPUs, so the groups share CPUs");
+    printf("\n Sequential makespan %.3f ms, concurrent makespan %.3f ms (%.2fx)\n",
+           sequential * 1e3, concurrent * 1e3, sequential / concurrent);
+
+#if defined(__linux__)
+    // Give the threads back the whole process mask
+    if (!numa_mode && !cpus.empty()) {
+#pragma omp parallel num_threads(team)
+        sched_setaffinity(0, sizeof(allowed), &allowed);
+    }
+#endif
+
+    // Check both results after one concurrent run from fresh data
+    initialize(M, N);
+    run_tasks_concurrently(tasks, cpus, alpha, beta);
+    check_correctness_routine1(alpha, beta, M);
+    check_correctness_routine2(alpha, beta, N);
+
+    free_arrays();
+    return 0;
+}
+
+/*---------------------------- Benchmark harness -----------------------------*/
+
+// Timing summary for one routine at one size
+struct bench_result {
+    const char* routine;
+    unsigned int M, N;
+    double min, median, p95, mean; // Seconds per call
+    double gbytes_per_sec;         // Based on the minimum time
+    double gflops;                 // Based on the minimum time
+};
+
+typedef void (*bench_routine_t)(float alpha, float beta, unsigned int size);
+
+// Value at fraction q of the sorted samples (nearest rank)
+static double percentile(const std::vector<double>& sorted, double q) {
+    size_t rank = (size_t)ceil(q * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+// Times `reps` calls of routine after `warmup` untimed calls. bytes and flops
+// are the memory traffic and floating point work of a single call.
+static bench_result bench_routine(const char* name, bench_routine_t routine, float alpha, float beta,
+                                  unsigned int M, unsigned int N, unsigned int size,
+                                  double bytes, double flops, const bench_options* opt) {
+
+    std::vector<double> times(opt->reps);
+    bench_result r;
+
+    for (int t = 0; t < opt->warmup; t++)
+        routine(alpha, beta, size);
+
+    for (int t = 0; t < opt->reps; t++) {
+        double start_time = omp_get_wtime();
+        routine(alpha, beta, size);
+        times[t] = omp_get_wtime() - start_time;
+    }
+
+    std::sort(times.begin(), times.end());
+
+    double total = 0.0;
+    for (int t = 0; t < opt->reps; t++)
+        total += times[t];
+
+    r.routine = name;
+    r.M = M;
+    r.N = N;
+    r.min = times[0];
+    r.median = percentile(times, 0.5);
+    r.p95 = percentile(times, 0.95);
+    r.mean = total / opt->reps;
+    r.gbytes_per_sec = r.min > 0.0 ? bytes / r.min * 1e-9 : 0.0;
+    r.gflops = r.min > 0.0 ? flops / r.min * 1e-9 : 0.0;
+    return r;
+}
+
+// Runs every routine for one (M, N) pair and appends the results
+static void bench_size(unsigned int M, unsigned int N, float alpha, float beta,
+                       const bench_options* opt, std::vector<bench_result>& results) {
+
+    // routine1: read y and z, write y; three flops per element
+    double r1_bytes = 3.0 * sizeof(float) * M;
+    double r1_flops = 3.0 * M;
+    // routine2: A streamed once, x read and w read/written; five flops per element of A
+    double r2_bytes = (double)sizeof(double) * N * N + 3.0 * sizeof(double) * N;
+    double r2_flops = 5.0 * N * N;
+    // routine2_par streams A in the storage precision selected by --precision
+    double r2p_bytes = (double)matrix_element_size(a_precision) * N * N + 3.0 * sizeof(double) * N;
+
+    allocate_arrays(M, N);
+
+    // initialize() runs once per size, so it gets a single sample
+    double start_time = omp_get_wtime();
+    initialize(M, N);
+    double init_time = omp_get_wtime() - start_time;
+    double init_bytes = (double)N * N * (sizeof(double) + (a_precision == PREC_FP64 ? 0 : matrix_element_size(a_precision)))
+                        + 3.0 * sizeof(float) * M + 3.0 * sizeof(double) * N;
+    bench_result init = { "initialize", M, N, init_time, init_time, init_time, init_time,
+                          init_time > 0.0 ? init_bytes / init_time * 1e-9 : 0.0, 0.0 };
+    results.push_back(init);
+
+    results.push_back(bench_routine("routine1", routine1, alpha, beta, M, N, M, r1_bytes, r1_flops, opt));
+    results.push_back(bench_routine("routine1_vec", routine1_vec, alpha, beta, M, N, M, r1_bytes, r1_flops, opt));
+    results.push_back(bench_routine("routine1_fused", routine1_fused, alpha, beta, M, N, M, r1_bytes, r1_flops, opt));
+    results.push_back(bench_routine("routine1_par", routine1_par, alpha, beta, M, N, M, r1_bytes, r1_flops, opt));
+    results.push_back(bench_routine("routine2", routine2, alpha, beta, M, N, N, r2_bytes, r2_flops, opt));
+    results.push_back(bench_routine("routine2_vec", routine2_vec, alpha, beta, M, N, N, r2_bytes, r2_flops, opt));
+    results.push_back(bench_routine("routine2_fused", routine2_fused, alpha, beta, M, N, N, r2_bytes, r2_flops, opt));
+    results.push_back(bench_routine("routine2_par", routine2_par, alpha, beta, M, N, N, r2p_bytes, r2_flops, opt));
+    results.push_back(bench_routine("routine2_det", routine2_det, alpha, beta, M, N, N, r2_bytes, r2_flops, opt));
+
+    free_arrays();
+}
+
+static void write_bench_results(FILE* out, const char* format, const std::vector<bench_result>& results,
+                                const bench_options* opt) {
+
+    if (strcmp(format, "json") == 0) {
+        fprintf(out, "{\n  \"isa\": \"%s\",\n  \"threads\": %d,\n  \"precision\": \"%s\",\n  \"warmup\": %d,\n"
+                     "  \"reps\": %d,\n  \"results\": [\n",
+                kernel_isa, omp_get_max_threads(), precision_name(a_precision), opt->warmup, opt->reps);
+        for (size_t k = 0; k < results.size(); k++) {
+            const bench_result& r = results[k];
+            fprintf(out, "    {\"routine\": \"%s\", \"M\": %u, \"N\": %u, \"min_s\": %.9g, \"median_s\": %.9g, "
+                         "\"p95_s\": %.9g, \"mean_s\": %.9g, \"gbytes_per_s\": %.4f, \"gflops\": %.4f}%s\n",
+                    r.routine, r.M, r.N, r.min, r.median, r.p95, r.mean, r.gbytes_per_sec, r.gflops,
+                    k + 1 < results.size() ? "," : "");
+        }
+        fprintf(out, "  ]\n}\n");
+    }
+    else if (strcmp(format, "csv") == 0) {
+        fprintf(out, "routine,M,N,isa,threads,min_s,median_s,p95_s,mean_s,gbytes_per_s,gflops\n");
+        for (size_t k = 0; k < results.size(); k++) {
+            const bench_result& r = results[k];
+            fprintf(out, "%s,%u,%u,%s,%d,%.9g,%.9g,%.9g,%.9g,%.4f,%.4f\n", r.routine, r.M, r.N, kernel_isa,
+                    omp_get_max_threads(), r.min, r.median, r.p95, r.mean, r.gbytes_per_sec, r.gflops);
+        }
+    }
+    else {
+        fprintf(out, "\n%s kernels, %d threads, %d warmup, %d reps\n", kernel_isa, omp_get_max_threads(),
+                opt->warmup, opt->reps);
+        fprintf(out, "%-14s %10s %7s %12s %12s %12s %9s %9s\n", "routine", "M", "N", "min (s)", "median (s)",
+                "p95 (s)", "GB/s", "GFLOP/s");
+        for (size_t k = 0; k < results.size(); k++) {
+            const bench_result& r = results[k];
+            fprintf(out, "%-14s %10u %7u %12.6f %12.6f %12.6f %9.2f %9.2f\n", r.routine, r.M, r.N, r.min, r.median,
+                    r.p95, r.gbytes_per_sec, r.gflops);
+        }
+    }
+}
+
+// Benchmark mode: times every routine at the given size, or with --sweep at
+// sizes ranging from L1-resident (16 KB) to DRAM-sized (256 MB / 512 MB).
+int run_benchmarks(const bench_options* opt, unsigned int M, unsigned int N, float alpha, float beta) {
+
+    static const unsigned int sweep_M[] = { 4096, 65536, 1048576, 16777216, 67108864 };
+    static const unsigned int sweep_N[] = { 32, 256, 1024, 4096, 8192 };
+    std::vector<bench_result> results;
+
+    if (strcmp(opt->format, "text") != 0 && strcmp(opt->format, "json") != 0 && strcmp(opt->format, "csv") != 0) {
+        fprintf(stderr, "Unknown benchmark format %s\n", opt->format);
+        return 1;
+    }
+
+    if (opt->sweep) {
+        for (size_t k = 0; k < sizeof(sweep_M) / sizeof(sweep_M[0]); k++)
+            bench_size(sweep_M[k], sweep_N[k], alpha, beta, opt, results);
+    }
+    else {
+        bench_size(M, N, alpha, beta, opt, results);
+    }
+
+    FILE* out = stdout;
+    if (opt->out) {
+        out = fopen(opt->out, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Unable to open file %s for writing\n", opt->out);
+            return 1;
+        }
+    }
+
+    write_bench_results(out, opt->format, results, opt);
+
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}